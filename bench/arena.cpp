@@ -0,0 +1,88 @@
+// Compares temporaries allocated from the phase arena to malloc and free.
+//
+// Builds many small linked lists of temporaries within a phase, once using
+// malloc and free and once using the arena of the phase, which releases
+// all of them at once when the phase ends. The phases report the time and
+// the number of allocation calls.
+//
+// Usage: arena [num_lists] [list_length] [huge_pages]
+
+#include <tudocomp_stat/StatPhase.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct node_t {
+    node_t* next;
+    size_t value;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t).count();
+}
+
+template<typename Alloc, typename Free>
+static size_t build(size_t num_lists, size_t length,
+    Alloc alloc, Free release) {
+
+    size_t sum = 0;
+    std::vector<node_t*> lists(num_lists, nullptr);
+    for(size_t i = 0; i < length; i++) {
+        for(auto& head : lists) {
+            auto node = (node_t*)alloc();
+            node->next = head;
+            node->value = i;
+            head = node;
+        }
+    }
+    for(auto head : lists) {
+        while(head) {
+            node_t* next = head->next;
+            sum += head->value;
+            release(head);
+            head = next;
+        }
+    }
+    return sum;
+}
+
+int main(int argc, char** argv) {
+    const size_t num_lists = argc > 1 ? std::stoul(argv[1]) : 1000;
+    const size_t length = argc > 2 ? std::stoul(argv[2]) : 10000;
+    const bool huge_pages = argc > 3 && std::stoul(argv[3]);
+
+    tdc::StatPhase::set_arena_options(64 * 1024 * 1024, huge_pages);
+
+    tdc::json stats;
+    stats["numLists"] = num_lists;
+    stats["listLength"] = length;
+    stats["hugePages"] = huge_pages;
+
+    tdc::StatPhase root("Root");
+    auto t = std::chrono::steady_clock::now();
+    {
+        tdc::StatPhase phase("malloc");
+        stats["sum"] = build(num_lists, length,
+            [](){ return malloc(sizeof(node_t)); },
+            [](node_t* node){ free(node); });
+    }
+    stats["secondsMalloc"] = seconds_since(t);
+
+    // includes releasing the arena at the end of the phase
+    t = std::chrono::steady_clock::now();
+    {
+        tdc::StatPhase phase("arena");
+        auto& arena = phase.arena();
+        build(num_lists, length,
+            [&](){ return arena.allocate(sizeof(node_t), alignof(node_t)); },
+            [](node_t*){});
+    }
+    stats["secondsArena"] = seconds_since(t);
+
+    stats["phases"] = root.to_json();
+    std::cout << stats.dump(4) << std::endl;
+}
@@ -0,0 +1,95 @@
+// Compares the allocators underlying the malloc override.
+//
+// Runs the same workload once for every malloc backend: many blocks of
+// random sizes are allocated and then released in random order, followed
+// by a churn of reallocations. Since the tracking layer is the same for all
+// backends, differences in time are due to the backends.
+//
+// Usage: backends [num_blocks] [max_block_size]
+
+#include <tudocomp_stat/StatPhase.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t).count();
+}
+
+static tdc::json run(const tdc::MallocBackend& backend,
+    std::vector<void*>& blocks, const std::vector<size_t>& sizes) {
+
+    tdc::StatPhase::set_malloc_backend(backend);
+
+    double time_alloc, time_realloc, time_free;
+    tdc::json phase_stats;
+    {
+        tdc::StatPhase phase(backend.name);
+        auto t = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < blocks.size(); i++) {
+            blocks[i] = malloc(sizes[i]);
+        }
+        time_alloc = seconds_since(t);
+
+        {
+            auto guard = tdc::StatPhase::suppress_tracking();
+            std::shuffle(blocks.begin(), blocks.end(), std::mt19937(147));
+        }
+
+        t = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < blocks.size(); i++) {
+            blocks[i] = realloc(blocks[i], sizes[blocks.size() - 1 - i]);
+        }
+        time_realloc = seconds_since(t);
+
+        t = std::chrono::steady_clock::now();
+        for(auto p : blocks) free(p);
+        time_free = seconds_since(t);
+
+        phase_stats = phase.to_json();
+    }
+
+    tdc::StatPhase::set_malloc_backend(tdc::libc_backend);
+
+    tdc::json stats;
+    stats["nsPerAlloc"] = time_alloc * 1e9 / double(blocks.size());
+    stats["nsPerRealloc"] = time_realloc * 1e9 / double(blocks.size());
+    stats["nsPerFree"] = time_free * 1e9 / double(blocks.size());
+    stats["phase"] = phase_stats;
+    return stats;
+}
+
+int main(int argc, char** argv) {
+    const size_t num_blocks = argc > 1 ? std::stoul(argv[1]) : 10000000;
+    const size_t max_size = argc > 2 ? std::stoul(argv[2]) : 256;
+
+    std::vector<void*> blocks(num_blocks);
+    std::vector<size_t> sizes(num_blocks);
+    {
+        std::mt19937 gen(42);
+        std::uniform_int_distribution<size_t> dist(1, max_size);
+        for(auto& s : sizes) s = dist(gen);
+    }
+
+    tdc::json stats;
+    stats["numBlocks"] = num_blocks;
+    stats["maxBlockSize"] = max_size;
+
+    for(auto backend : { &tdc::libc_backend, &tdc::size_class_backend }) {
+        try {
+            stats[backend->name] = run(*backend, blocks, sizes);
+        } catch(const std::runtime_error& e) {
+            // backends may not be available, e.g., in headerless mode
+            std::cerr << e.what() << std::endl;
+        }
+    }
+
+    std::cout << stats.dump(4) << std::endl;
+}
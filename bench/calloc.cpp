@@ -0,0 +1,88 @@
+// Measures large zero-initialized allocations.
+//
+// Allocates a large block using calloc and reads a sparse subset of it,
+// once more after writing to a fraction of its pages. Compared to malloc
+// followed by memset, calloc leaves fresh pages untouched, so the resident
+// set only grows with the pages that are actually written.
+//
+// Usage: calloc [megabytes] [touched_per_mille]
+
+#include <tudocomp_stat/StatPhase.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+// the current resident set size in bytes
+static size_t resident_bytes() {
+    size_t pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%zu %zu", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t).count();
+}
+
+template<typename Alloc>
+static tdc::json run(const char* title, size_t bytes, size_t touched,
+    Alloc alloc) {
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t rss_before = resident_bytes();
+
+    tdc::json stats;
+    tdc::StatPhase phase(title);
+    {
+        auto t = std::chrono::steady_clock::now();
+        char* volatile block = (char*)alloc(bytes);
+        stats["secondsAlloc"] = seconds_since(t);
+        stats["rssAlloc"] = resident_bytes() - rss_before;
+
+        // touch some pages, e.g., like a sparse bit vector
+        const size_t step = page_size * 1000 / std::max<size_t>(touched, 1);
+        t = std::chrono::steady_clock::now();
+        if(touched) {
+            for(size_t i = 0; i < bytes; i += step) block[i] = 1;
+        }
+        stats["secondsTouch"] = seconds_since(t);
+        stats["rssTouched"] = resident_bytes() - rss_before;
+
+        free(block);
+    }
+    stats["phase"] = phase.to_json();
+    return stats;
+}
+
+int main(int argc, char** argv) {
+    const size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 1024;
+    const size_t touched = argc > 2 ? std::stoul(argv[2]) : 10;
+    const size_t bytes = megabytes << 20;
+
+    tdc::json stats;
+    stats["bytes"] = bytes;
+    stats["touchedPerMille"] = touched;
+
+    stats["calloc"] = run("calloc", bytes, touched,
+        [](size_t n){ return calloc(n, 1); });
+    stats["mallocMemset"] = run("malloc+memset", bytes, touched,
+        [](size_t n){
+            // volatile keeps the compiler from turning this into calloc
+            void* volatile p = malloc(n);
+            if(p) memset(p, 0, n);
+            return (void*)p;
+        });
+
+    std::cout << stats.dump(4) << std::endl;
+}
@@ -0,0 +1,67 @@
+// Compares the cost of phases timed with the monotonic clock and with the
+// time stamp counter.
+//
+// Starts and ends many empty phases, once for each clock, and reports the
+// average time per phase in nanoseconds. The phases have no parent, so
+// their data is not collected. Furthermore, reports the average time of
+// reading either clock alone.
+//
+// Usage: clock [num_phases]
+
+#include <tudocomp_stat/StatPhase.hpp>
+#include <tudocomp_stat/TscClock.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+static double nanos_per_phase(size_t num_phases) {
+    auto t = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < num_phases; i++) {
+        tdc::StatPhase phase("phase");
+    }
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - t).count() / double(num_phases);
+}
+
+template<typename F>
+static double nanos_per_read(size_t num_reads, F read) {
+    volatile double sum = 0;
+    auto t = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < num_reads; i++) {
+        sum = sum + read();
+    }
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - t).count() / double(num_reads);
+}
+
+int main(int argc, char** argv) {
+    const size_t num_phases = argc > 1 ? std::stoul(argv[1]) : 100000;
+
+    tdc::json stats;
+    stats["numPhases"] = num_phases;
+
+    tdc::StatPhase::set_time_source(tdc::StatPhase::TIME_MONOTONIC);
+    stats["nanosMonotonic"] = nanos_per_phase(num_phases);
+
+    const bool tsc =
+        tdc::StatPhase::set_time_source(tdc::StatPhase::TIME_TSC);
+    stats["tscAvailable"] = tsc;
+    if(tsc) stats["nanosTsc"] = nanos_per_phase(num_phases);
+
+    const size_t num_reads = 100 * num_phases;
+    stats["nanosReadMonotonic"] = nanos_per_read(num_reads, [](){
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return double(t.tv_nsec);
+    });
+
+    tdc::TscClock clock;
+    if(clock.calibrate()) {
+        stats["nanosReadTsc"] = nanos_per_read(num_reads, [&](){
+            return clock.millis();
+        });
+    }
+
+    std::cout << stats.dump(4) << std::endl;
+}
@@ -0,0 +1,85 @@
+// Measures the footprint and throughput of the malloc override.
+//
+// Allocates many small blocks within a phase and compares the amount of
+// tracked memory to the growth of the resident set. Build the library
+// with and without MALLOC_HEADERLESS to compare both tracking modes, or pass
+// a sample interval to measure allocation sampling.
+//
+// Usage: malloc_overhead [num_blocks] [block_size] [sample_interval]
+
+#include <tudocomp_stat/StatPhase.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// the current resident set size in bytes
+static size_t resident_bytes() {
+    size_t pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%zu %zu", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t).count();
+}
+
+int main(int argc, char** argv) {
+    const size_t num_blocks = argc > 1 ? std::stoul(argv[1]) : 10000000;
+    const size_t block_size = argc > 2 ? std::stoul(argv[2]) : 32;
+    const size_t sample_interval = argc > 3 ? std::stoul(argv[3]) : 0;
+
+    tdc::StatPhase::set_sample_interval(sample_interval);
+
+    std::vector<void*> blocks(num_blocks);
+
+    const size_t rss_before = resident_bytes();
+    double time_alloc, time_free;
+    size_t rss_peak;
+
+    tdc::StatPhase root("Root");
+    {
+        tdc::StatPhase phase("Allocate");
+        auto t = std::chrono::steady_clock::now();
+        for(auto& p : blocks) p = malloc(block_size);
+        time_alloc = seconds_since(t);
+        rss_peak = resident_bytes();
+
+        phase.split("Free");
+        t = std::chrono::steady_clock::now();
+        for(auto p : blocks) free(p);
+        time_free = seconds_since(t);
+    }
+
+    auto phases = root.to_json();
+    const size_t tracked = phases["sub"][0]["memPeak"];
+    const size_t rss = rss_peak - rss_before;
+
+    tdc::json stats;
+#ifdef MALLOC_HEADERLESS
+    stats["mode"] = "headerless";
+#else
+    stats["mode"] = "header";
+#endif
+    stats["numBlocks"] = num_blocks;
+    stats["blockSize"] = block_size;
+    stats["sampleInterval"] = sample_interval;
+    stats["residentBytes"] = rss;
+    stats["residentPerBlock"] = double(rss) / double(num_blocks);
+    stats["overhead"] = double(rss) / double(num_blocks * block_size);
+    stats["trackedBytes"] = tracked;
+    stats["nsPerMalloc"] = time_alloc * 1e9 / double(num_blocks);
+    stats["nsPerFree"] = time_free * 1e9 / double(num_blocks);
+    stats["phases"] = phases;
+
+    std::cout << stats.dump(4) << std::endl;
+}
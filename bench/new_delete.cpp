@@ -0,0 +1,78 @@
+// Compares the cost of tracked C++ deallocations to that of free.
+//
+// Allocates many small blocks within a phase and releases them in random
+// order, once using malloc and free, which read the block header to find
+// the size, and once using operator new and the sized operator delete,
+// which receive the size as an argument.
+//
+// Usage: new_delete [num_blocks] [block_size]
+
+#include <tudocomp_stat/StatPhase.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t).count();
+}
+
+template<typename Alloc, typename Free>
+static tdc::json run(std::vector<void*>& blocks, Alloc alloc, Free release) {
+    double time_alloc, time_free;
+    {
+        tdc::StatPhase phase("Allocate");
+        auto t = std::chrono::steady_clock::now();
+        for(auto& p : blocks) p = alloc();
+        time_alloc = seconds_since(t);
+
+        // free in random order, so headers are unlikely to be cached
+        {
+            auto guard = tdc::StatPhase::suppress_tracking();
+            std::shuffle(blocks.begin(), blocks.end(), std::mt19937(147));
+        }
+
+        phase.split("Free");
+        t = std::chrono::steady_clock::now();
+        for(auto p : blocks) release(p);
+        time_free = seconds_since(t);
+    }
+
+    tdc::json stats;
+    stats["nsPerAlloc"] = time_alloc * 1e9 / double(blocks.size());
+    stats["nsPerFree"] = time_free * 1e9 / double(blocks.size());
+    return stats;
+}
+
+int main(int argc, char** argv) {
+    const size_t num_blocks = argc > 1 ? std::stoul(argv[1]) : 10000000;
+    const size_t block_size = argc > 2 ? std::stoul(argv[2]) : 32;
+
+    std::vector<void*> blocks(num_blocks);
+
+    tdc::json stats;
+    stats["numBlocks"] = num_blocks;
+    stats["blockSize"] = block_size;
+
+    tdc::StatPhase root("Root");
+    {
+        tdc::StatPhase phase("malloc");
+        stats["malloc"] = run(blocks,
+            [&](){ return malloc(block_size); },
+            [&](void* p){ free(p); });
+    }
+    {
+        tdc::StatPhase phase("new");
+        stats["new"] = run(blocks,
+            [&](){ return ::operator new(block_size); },
+            [&](void* p){ ::operator delete(p, block_size); });
+    }
+
+    stats["phases"] = root.to_json();
+    std::cout << stats.dump(4) << std::endl;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension recording a histogram of allocation sizes per phase.
+///
+/// Allocations are grouped into buckets by the binary logarithm of their
+/// size, i.e., bucket \c k holds allocations of at least \c 2^k and less
+/// than \c 2^(k+1) bytes. For each bucket, the number of allocations and the
+/// total amount of allocated bytes are recorded.
+///
+/// If allocations are sampled, the sampled allocations are still grouped by
+/// their size, but counted with their weight, so the counts and bytes are
+/// estimates.
+///
+/// The histogram of a phase includes those of its sub phases. It is written
+/// as the \c allocHistogram statistic, containing an entry for every bucket
+/// that is not empty.
+///
+/// Register using \ref StatPhase::register_extension.
+class AllocHistogram : public StatPhaseExtension {
+public:
+    /// \brief The number of buckets.
+    static constexpr size_t num_buckets = 64;
+
+private:
+    // counts are kept in fixed point with this many fractional bits, since a
+    // sampled allocation stands for a fraction of allocations of its size
+    static constexpr size_t count_shift = 16;
+
+    struct bucket_t {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> bytes;
+    };
+
+    bucket_t m_buckets[num_buckets];
+
+    inline static size_t bucket_of(size_t bytes) {
+        return bytes ? 63 - __builtin_clzll(bytes) : 0;
+    }
+
+public:
+    inline AllocHistogram() {
+        for(auto& b : m_buckets) {
+            b.count = 0;
+            b.bytes = 0;
+        }
+    }
+
+    virtual void on_alloc(size_t bytes, size_t weight) override {
+        const uint64_t one = uint64_t(1) << count_shift;
+        const uint64_t count = (weight == bytes || !bytes) ? one
+            : uint64_t(double(weight) / double(bytes) * double(one));
+
+        auto& b = m_buckets[bucket_of(bytes)];
+        b.count.fetch_add(count, std::memory_order_relaxed);
+        b.bytes.fetch_add(weight, std::memory_order_relaxed);
+    }
+
+    virtual void propagate(const StatPhaseExtension& ext) override {
+        auto& sub = *((const AllocHistogram*)&ext);
+        for(size_t k = 0; k < num_buckets; k++) {
+            m_buckets[k].count += sub.m_buckets[k].count.load();
+            m_buckets[k].bytes += sub.m_buckets[k].bytes.load();
+        }
+    }
+
+    virtual void write(json& data) override {
+        json histogram = json::array();
+        for(size_t k = 0; k < num_buckets; k++) {
+            const uint64_t count = (m_buckets[k].count.load() +
+                (uint64_t(1) << (count_shift - 1))) >> count_shift;
+            if(count) {
+                histogram.push_back(json({
+                    {"minSize", uint64_t(1) << k},
+                    {"count", count},
+                    {"bytes", m_buckets[k].bytes.load()}
+                }));
+            }
+        }
+        data["allocHistogram"] = histogram;
+    }
+};
+
+}
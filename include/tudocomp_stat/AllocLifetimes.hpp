@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension recording a histogram of allocation lifetimes per phase.
+///
+/// Once this extension is used, allocated blocks are timestamped, so their
+/// lifetime can be determined when they are freed. Lifetimes are attributed
+/// to the phase in which the block is freed and grouped into buckets twice:
+/// by the binary logarithm of the lifetime in nanoseconds and by the binary
+/// logarithm of the number of phases that finished during the lifetime.
+/// Short lifetimes indicate temporary allocations, whereas blocks surviving
+/// phases are likely part of long-lived structures.
+///
+/// Only blocks allocated after the first phase using this extension has
+/// started are timestamped. Timestamps require block headers, so nothing is
+/// recorded if the malloc override is headerless.
+///
+/// The histograms of a phase include those of its sub phases. They are
+/// written as the \c allocLifetimes statistic, containing an entry for every
+/// bucket that is not empty.
+///
+/// Register using \ref StatPhase::register_extension.
+class AllocLifetimes : public StatPhaseExtension {
+public:
+    /// \brief The number of buckets per histogram.
+    static constexpr size_t num_buckets = 65;
+
+private:
+    std::atomic<uint64_t> m_by_time[num_buckets];
+    std::atomic<uint64_t> m_by_phases[num_buckets];
+
+    // bucket 0 holds zero, bucket k > 0 holds [2^(k-1), 2^k)
+    inline static size_t bucket_of(uint64_t x) {
+        return x ? 64 - __builtin_clzll(x) : 0;
+    }
+
+    inline static uint64_t min_of(size_t bucket) {
+        return bucket ? uint64_t(1) << (bucket - 1) : 0;
+    }
+
+public:
+    AllocLifetimes();
+
+    virtual void on_lifetime(uint64_t nanoseconds, size_t phases) override {
+        m_by_time[bucket_of(nanoseconds)].fetch_add(
+            1, std::memory_order_relaxed);
+        m_by_phases[bucket_of(phases)].fetch_add(
+            1, std::memory_order_relaxed);
+    }
+
+    virtual void propagate(const StatPhaseExtension& ext) override {
+        auto& sub = *((const AllocLifetimes*)&ext);
+        for(size_t k = 0; k < num_buckets; k++) {
+            m_by_time[k] += sub.m_by_time[k].load();
+            m_by_phases[k] += sub.m_by_phases[k].load();
+        }
+    }
+
+    virtual void write(json& data) override {
+        auto histogram = [](const std::atomic<uint64_t>* buckets,
+                            const char* key) {
+            json list = json::array();
+            for(size_t k = 0; k < num_buckets; k++) {
+                const uint64_t count = buckets[k].load();
+                if(count) {
+                    list.push_back(json({
+                        {key, min_of(k)},
+                        {"count", count}
+                    }));
+                }
+            }
+            return list;
+        };
+
+        data["allocLifetimes"] = json({
+            {"byTime", histogram(m_by_time, "minNanos")},
+            {"byPhases", histogram(m_by_phases, "minPhases")}
+        });
+    }
+};
+
+}
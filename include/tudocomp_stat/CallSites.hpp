@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension attributing the allocations of a phase to call sites.
+///
+/// For every allocation, the call stack is captured by following the chain
+/// of frame pointers starting at the allocation function. Allocations with
+/// the same call stack are aggregated and the top call sites by allocated
+/// bytes and by number of allocations are written as the \c callSites
+/// statistic. The call sites of a phase include those of its sub phases.
+///
+/// Only raw return addresses are captured at runtime. Along with them, the
+/// relevant part of \c /proc/self/maps is written, so the call sites can be
+/// symbolized offline using \c tools/symbolize_callsites.py.
+///
+/// Frame pointer unwinding is cheap, but requires the code of interest to be
+/// compiled with \c -fno-omit-frame-pointer. Frames of code compiled without
+/// frame pointers are skipped or end the call stack.
+///
+/// Call sites are aggregated per thread, so allocating threads do not
+/// contend, and merged when the phase is written. Still, capturing every
+/// allocation is costly, so this extension is meant for finding the origin
+/// of allocations rather than for measuring.
+///
+/// Register using \ref StatPhase::register_extension.
+class CallSites : public StatPhaseExtension {
+public:
+    /// \brief The maximum call stack depth.
+    static constexpr size_t max_depth = 64;
+
+    /// \brief Sets the call stack depth to capture (default 8).
+    static void set_depth(size_t depth);
+
+    /// \brief Sets the number of top call sites to write (default 10).
+    static void set_top(size_t top);
+
+    /// \brief Captures the call stack of the current allocation.
+    ///
+    /// \param frames the array receiving the return addresses
+    /// \param depth  the maximum number of frames to capture
+    /// \return the number of captured frames
+    static size_t capture(uintptr_t* frames, size_t depth);
+
+    /// \brief Returns the current call stack depth to capture.
+    static size_t depth();
+
+    /// \brief Writes a call stack as a list of hexadecimal addresses.
+    static json frames_of(const std::vector<uintptr_t>& stack);
+
+    /// \brief Writes the executable mappings containing the given addresses.
+    ///
+    /// Along with the frames, these allow for symbolization using
+    /// \c tools/symbolize_callsites.py.
+    static json mappings_of(const std::vector<uintptr_t>& addresses);
+
+private:
+    static std::atomic<size_t> s_depth;
+    static std::atomic<size_t> s_top;
+
+    using stack_t = std::vector<uintptr_t>;
+
+    struct site_t {
+        stack_t stack;
+        uint64_t count;
+        uint64_t bytes;
+    };
+
+    // call sites by the hash of their call stack
+    using site_map_t = std::unordered_multimap<size_t, site_t>;
+
+    static size_t hash_of(const uintptr_t* frames, size_t n);
+
+    // Adds to the call site of the given call stack, which only allocates
+    // if the call site is new.
+    static void add(site_map_t& sites, size_t hash,
+        const uintptr_t* frames, size_t n, uint64_t count, uint64_t bytes);
+
+    static void add_all(site_map_t& sites, const site_map_t& other);
+
+    // The call sites recorded by a single thread. The lock is only contended
+    // while the phase is written.
+    struct shard_t {
+        std::thread::id thread;
+        std::mutex mutex;
+        site_map_t sites;
+    };
+
+    // the shard of the calling thread used last, identified by the
+    // instance it belongs to
+    struct shard_cache_t {
+        uint64_t id;
+        shard_t* shard;
+    };
+
+    static std::atomic<uint64_t> s_next_id;
+    static thread_local shard_cache_t s_shard_cache;
+
+    const uint64_t m_id;
+
+    // the shards of the threads and the call sites of finished sub phases
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<shard_t>> m_shards;
+    site_map_t m_sites;
+
+    // Returns the shard of the calling thread.
+    shard_t& shard();
+
+    // Merges all call sites recorded so far, the lock must be held.
+    void collect(site_map_t& sites) const;
+
+public:
+    CallSites();
+
+    virtual void on_alloc(size_t bytes, size_t weight) override;
+    virtual void propagate(const StatPhaseExtension& ext) override;
+    virtual void write(json& data) override;
+};
+
+}
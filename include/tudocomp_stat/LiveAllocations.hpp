@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_set>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension reporting the allocations of a phase that are still
+///        alive when it ends.
+///
+/// Once this extension is used, every allocated block is entered into a
+/// table along with its size, the phase it was allocated in and optionally
+/// its call site, and removed again when it is freed. When a phase ends, the
+/// blocks allocated during the phase (including its sub phases) that have
+/// not been freed are grouped by call site and written as the
+/// \c liveAllocations statistic. This reveals memory retained across phase
+/// boundaries, which inflates the peaks of later phases.
+///
+/// Call sites are captured like in \ref CallSites, using the depth set by
+/// \ref CallSites::set_depth, and can be symbolized offline using
+/// \c tools/symbolize_callsites.py.
+///
+/// Sub phases are only included once they are finished. Entries of blocks
+/// that no running phase can report anymore are dropped when the root phase
+/// ends, as blocks freed outside of any phase are not reported.
+///
+/// The table is guarded by a lock, so this extension is meant for finding
+/// leaks rather than for measuring.
+///
+/// Register using \ref StatPhase::register_extension.
+class LiveAllocations : public StatPhaseExtension {
+public:
+    /// \brief Sets whether call sites are captured (default true).
+    static void set_record_sites(bool record);
+
+    /// \brief Sets the number of top call sites to write (default 10).
+    static void set_top(size_t top);
+
+private:
+    static std::atomic<bool> s_record_sites;
+    static std::atomic<size_t> s_top;
+
+    // the numbers identifying the phases blocks are allocated in
+    static std::atomic<uint64_t> s_next_id;
+    const uint64_t m_id;
+
+    // this phase and its finished sub phases
+    std::unordered_set<uint64_t> m_phases;
+
+    // whether the phases have been propagated to a parent phase, otherwise
+    // their blocks are dropped from the table when this phase ends
+    mutable bool m_propagated = false;
+
+public:
+    LiveAllocations();
+    virtual ~LiveAllocations();
+
+    virtual void on_block_alloc(const void* ptr, size_t bytes) override;
+    virtual void on_block_free(const void* ptr) override;
+    virtual void propagate(const StatPhaseExtension& ext) override;
+    virtual void write(json& data) override;
+};
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+namespace tdc {
+
+/// \brief An allocator underlying the malloc override.
+///
+/// The malloc override tracks allocations and forwards them to the backend
+/// selected using \ref StatPhase::set_malloc_backend. Since the override
+/// knows the size of every block, backends receive the size of a block when
+/// it is reallocated or freed and need not store it themselves.
+///
+/// Backends must not call the allocation functions of the program (i.e.,
+/// \c malloc or \c operator \c new) themselves.
+struct MallocBackend {
+    /// \brief The name of the backend.
+    const char* name;
+
+    /// \brief Allocates a block aligned like blocks returned by \c malloc.
+    void* (*malloc)(size_t size);
+
+    /// \brief Allocates a block with the given alignment, a power of two
+    ///        smaller than the size.
+    void* (*memalign)(size_t alignment, size_t size);
+
+    /// \brief Resizes a block allocated using \ref malloc, possibly moving
+    ///        it.
+    void* (*realloc)(void* ptr, size_t old_size, size_t new_size);
+
+    /// \brief Frees a block of the given size.
+    void (*free)(void* ptr, size_t size);
+};
+
+/// \brief The allocator of glibc, which is used by default.
+extern const MallocBackend libc_backend;
+
+/// \brief A bundled allocator serving small blocks from thread caches.
+///
+/// Blocks of up to 32 KiB are rounded up to a power of two and taken from a
+/// free list of the calling thread, which is refilled from 64 KiB chunks.
+/// Freed blocks are put into the free list of the freeing thread, the lists
+/// of exited threads are reused by other threads. Chunks are never returned
+/// to the system. Larger blocks are allocated using glibc.
+extern const MallocBackend size_class_backend;
+
+}
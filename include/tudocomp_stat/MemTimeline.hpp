@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension recording the memory of a phase over time.
+///
+/// Whenever the memory of a phase has changed by at least a minimum amount
+/// of bytes, or has changed at all and a minimum amount of time has passed
+/// since the last point, a point is recorded holding the time, the current
+/// memory and the peak memory since the previous point, so short spikes
+/// are not lost. If a phase exceeds the maximum number of points, every
+/// other point is dropped and both minimum deltas are doubled for that
+/// phase.
+///
+/// The timeline of a phase includes those of its sub phases. As the phases
+/// of attached threads may run concurrently, the timelines are merged by
+/// time, adding up the bytes of the phases at each point. The peak of a
+/// merged point adds the bytes of the other phases to the peak it had in
+/// its own phase.
+///
+/// The timeline is written as the \c memTimeline statistic, a list of
+/// points with the time in milliseconds since the phase started and the
+/// amounts in bytes relative to the start of the phase, like \c memFinal
+/// and \c memPeak.
+///
+/// Every allocation takes a lock, so this extension is meant for
+/// visualization rather than for measuring throughput.
+///
+/// Register using \ref StatPhase::register_extension.
+class MemTimeline : public StatPhaseExtension {
+public:
+    /// \brief Sets the minimum change in bytes (default 64 KiB) and the
+    ///        minimum time in milliseconds (default 1) between points.
+    static void set_min_delta(size_t bytes, double milliseconds);
+
+    /// \brief Sets the maximum number of points per phase (default 1000).
+    static void set_max_points(size_t points);
+
+private:
+    static std::atomic<size_t> s_min_bytes;
+    static std::atomic<uint64_t> s_min_nanos;
+    static std::atomic<size_t> s_max_points;
+
+    struct point_t {
+        uint64_t time;
+        ssize_t bytes;
+        ssize_t peak;
+    };
+
+    mutable std::mutex m_mutex;
+    uint64_t m_start;
+    uint64_t m_end = 0;
+    size_t m_min_bytes;
+    uint64_t m_min_nanos;
+
+    ssize_t m_current = 0;
+    ssize_t m_peak = 0; // since the last point
+    std::vector<point_t> m_points;
+
+    void update(ssize_t delta);
+    void downsample();
+
+public:
+    MemTimeline();
+
+    virtual void on_alloc(size_t bytes, size_t weight) override;
+    virtual void on_free(size_t bytes) override;
+    virtual void finish() override;
+    virtual void propagate(const StatPhaseExtension& ext) override;
+    virtual void write(json& data) override;
+};
+
+}
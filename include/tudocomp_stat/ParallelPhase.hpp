@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <tudocomp_stat/StatPhase.hpp>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace tdc {
+
+/// \brief A phase for a parallel region with a sub phase per thread.
+///
+/// The phase is started on construction like a \ref StatPhase. Every
+/// thread working in the region calls \ref run, which executes the
+/// thread's share of the work in a sub phase titled by the thread's index,
+/// using \ref StatPhase::attach_thread. The sub phases appear in the order
+/// of the thread index.
+///
+/// When the phase ends, the wall times the threads spent in \ref run are
+/// aggregated and logged as user statistics: the number of threads
+/// (\c threads), the minimum, maximum and mean time in milliseconds
+/// (\c threadTimeMin, \c threadTimeMax, \c threadTimeMean) and the load
+/// imbalance (\c loadImbalance), i.e., the ratio of the maximum and the
+/// mean time. An imbalance of 1 means that all threads were equally busy,
+/// larger values reveal stragglers.
+///
+/// With OpenMP, a combined <tt>parallel for</tt> directive has to be split
+/// up so the loop can be wrapped:
+/// \code
+/// tdc::ParallelPhase region("Sort");
+/// #pragma omp parallel
+/// region.run([&](){
+///     #pragma omp for
+///     for(size_t i = 0; i < n; i++) { ... }
+/// });
+/// \endcode
+class ParallelPhase {
+private:
+    StatPhase m_phase;
+
+    std::mutex m_mutex;
+    std::vector<double> m_thread_times;
+
+    // the few allocations here are balanced within the region's phase
+    inline void add_time(size_t index, double millis) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(index >= m_thread_times.size()) {
+            m_thread_times.resize(index + 1, 0.0);
+        }
+        m_thread_times[index] += millis;
+    }
+
+    inline void log_thread_times() {
+        // threads that never ran are not counted
+        size_t num = 0;
+        double min = 0, max = 0, sum = 0;
+        for(double t : m_thread_times) {
+            if(t <= 0) continue;
+            min = num ? std::min(min, t) : t;
+            max = std::max(max, t);
+            sum += t;
+            ++num;
+        }
+        if(!num) return;
+
+        const double mean = sum / double(num);
+        m_phase.log_stat("threads", num);
+        m_phase.log_stat("threadTimeMin", min);
+        m_phase.log_stat("threadTimeMax", max);
+        m_phase.log_stat("threadTimeMean", mean);
+        m_phase.log_stat("loadImbalance", mean > 0 ? max / mean : 1.0);
+    }
+
+public:
+    /// \brief Starts the phase of a parallel region.
+    ///
+    /// Must be called by the thread executing the enclosing phase, before
+    /// entering the region.
+    ///
+    /// \param title the phase title
+    inline ParallelPhase(std::string&& title) : m_phase(std::move(title)) {
+    }
+
+    /// \brief Ends the phase and logs the aggregated thread times.
+    ///
+    /// All threads must have returned from \ref run.
+    inline ~ParallelPhase() {
+        log_thread_times();
+    }
+
+    /// \brief Executes a thread's share of the region in a sub phase.
+    ///
+    /// May be called concurrently by any number of threads, each passing its
+    /// own index, and multiple times by the same thread.
+    ///
+    /// \param index the index of the calling thread
+    /// \param func  the lambda to execute
+    template<typename F>
+    inline void run(size_t index, F func) {
+        auto attached = StatPhase::attach_thread(m_phase, index);
+        const auto start = std::chrono::steady_clock::now();
+        {
+            StatPhase phase("Thread " + std::to_string(index));
+            func();
+        }
+        add_time(index, std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+#ifdef _OPENMP
+    /// \brief Executes an OpenMP thread's share of the region in a sub phase.
+    ///
+    /// The index of the calling thread is determined by
+    /// \c omp_get_thread_num.
+    ///
+    /// \param func the lambda to execute
+    template<typename F>
+    inline void run(F func) {
+        run(size_t(omp_get_thread_num()), func);
+    }
+#endif
+
+    /// \brief Returns the phase of the region.
+    inline StatPhase& phase() {
+        return m_phase;
+    }
+};
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension reading hardware performance counters per phase.
+///
+/// When a phase starts, a group of counters is opened for the calling
+/// thread using \c perf_event_open. Only one group counts at a time: a sub
+/// phase disables the group of its parent until it finishes, and the parent
+/// receives the counts of the sub phase like other statistics. The phases
+/// of attached threads count the threads running them. Counting is
+/// paused while tracking is paused (see \ref StatPhase::pause_tracking).
+/// Only user space is counted and counts are scaled up if the kernel had
+/// to multiplex the counters.
+///
+/// Events that are not supported by the machine are omitted. If no event
+/// can be opened, e.g., because \c perf_event_paranoid forbids it, only the
+/// reason is written.
+///
+/// The counts are written as the \c perfCounters statistic together with
+/// the instructions per cycle and the cache and branch miss rates, if the
+/// respective events are counted.
+///
+/// Register using \ref StatPhase::register_extension.
+class PerfCounters : public StatPhaseExtension {
+public:
+    /// \brief The available events.
+    enum event_t : uint32_t {
+        CYCLES           = 1 << 0,
+        INSTRUCTIONS     = 1 << 1,
+        CACHE_REFERENCES = 1 << 2,
+        CACHE_MISSES     = 1 << 3,
+        BRANCHES         = 1 << 4,
+        BRANCH_MISSES    = 1 << 5,
+        DTLB_LOAD_MISSES = 1 << 6,
+        ALL_EVENTS       = (1 << 7) - 1
+    };
+
+    /// \brief The number of available events.
+    static constexpr size_t num_events = 7;
+
+    /// \brief Sets the events counted in phases started hereafter as a
+    ///        combination of \ref event_t flags (default: all).
+    static void set_events(uint32_t events);
+
+private:
+    static std::atomic<uint32_t> s_events;
+
+    // the innermost group of the calling thread, which is the one counting
+    static thread_local PerfCounters* s_active;
+
+    PerfCounters* m_outer;
+
+    // the opened counters in group order, the first is the group leader
+    int m_fds[num_events];
+    size_t m_num_fds = 0;
+    size_t m_events[num_events];
+    int m_error = 0;
+
+    // the events counted by this phase or any of its sub phases
+    uint32_t m_counted = 0;
+
+    // the counts of finished sub phases per event
+    uint64_t m_sub[num_events];
+
+    // the counts of this phase once its counters are closed
+    uint64_t m_final[num_events];
+    bool m_closed = false;
+
+    void enable() const;
+    void disable() const;
+
+    // reads the final counts and closes the counters
+    void close();
+
+    // reads the counts of this phase including its sub phases per event
+    void read(uint64_t counts[num_events]) const;
+
+public:
+    PerfCounters();
+    virtual ~PerfCounters();
+
+    virtual void pause() override;
+    virtual void resume() override;
+    virtual void finish() override;
+    virtual void propagate(const StatPhaseExtension& ext) override;
+    virtual void write(json& data) override;
+};
+
+}
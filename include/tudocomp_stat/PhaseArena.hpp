@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include <sys/mman.h>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define TDC_STAT_ARENA_PMR
+#endif
+#endif
+
+namespace tdc {
+
+/// \brief A monotonic arena that releases all of its memory at once.
+///
+/// Memory is handed out from chunks by bumping a pointer and deallocating
+/// does nothing. All chunks are freed together when the arena is released,
+/// which suits temporaries that die together, e.g., with a phase (see
+/// \ref StatPhase::arena). Chunks are allocated using \c malloc, so they are
+/// tracked like any other allocation.
+///
+/// When compiled as C++17, the arena is a \c std::pmr::memory_resource and
+/// can back \c std::pmr containers. The arena is not thread-safe.
+class PhaseArena
+#ifdef TDC_STAT_ARENA_PMR
+    : public std::pmr::memory_resource
+#endif
+{
+public:
+    /// \brief The size of huge pages that chunks are aligned to, if enabled.
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+private:
+    // chunks are linked through a header at their start
+    struct chunk_t {
+        chunk_t* next;
+    };
+
+    size_t m_chunk_size;
+    bool m_huge_pages;
+
+    chunk_t* m_chunks = nullptr;
+    uintptr_t m_pos = 0;
+    uintptr_t m_end = 0;
+
+    size_t m_allocated = 0;
+    size_t m_num_chunks = 0;
+
+    inline void add_chunk(size_t min_bytes) {
+        size_t size = std::max(m_chunk_size, min_bytes + sizeof(chunk_t));
+
+        chunk_t* chunk;
+        if(m_huge_pages) {
+            size = (size + huge_page_size - 1) / huge_page_size *
+                huge_page_size;
+            chunk = (chunk_t*)aligned_alloc(huge_page_size, size);
+#ifdef MADV_HUGEPAGE
+            if(chunk) madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+        } else {
+            chunk = (chunk_t*)malloc(size);
+        }
+        if(!chunk) throw std::bad_alloc();
+
+        chunk->next = m_chunks;
+        m_chunks = chunk;
+        m_pos = uintptr_t(chunk) + sizeof(chunk_t);
+        m_end = uintptr_t(chunk) + size;
+        ++m_num_chunks;
+    }
+
+public:
+    /// \brief Creates an empty arena.
+    ///
+    /// \param chunk_size the minimum size of the chunks in bytes
+    /// \param huge_pages whether chunks are aligned to huge pages and the
+    ///                   kernel is advised to back them by such
+    inline PhaseArena(size_t chunk_size, bool huge_pages = false)
+        : m_chunk_size(chunk_size), m_huge_pages(huge_pages) {
+    }
+
+    PhaseArena(const PhaseArena&) = delete;
+    PhaseArena& operator=(const PhaseArena&) = delete;
+
+    inline ~PhaseArena() {
+        release();
+    }
+
+    /// \brief Allocates memory from the arena.
+    ///
+    /// \param bytes the amount of bytes
+    /// \param alignment the alignment, a power of two
+    /// \return the allocated memory, which stays valid until the arena is
+    ///         released
+    inline void* allocate(size_t bytes,
+        size_t alignment = alignof(std::max_align_t)) {
+
+        uintptr_t p = (m_pos + alignment - 1) & ~uintptr_t(alignment - 1);
+        if(!m_chunks || p + bytes > m_end) {
+            add_chunk(bytes + alignment - 1);
+            p = (m_pos + alignment - 1) & ~uintptr_t(alignment - 1);
+        }
+
+        m_pos = p + bytes;
+        m_allocated += bytes;
+        return (void*)p;
+    }
+
+    /// \brief Does nothing, memory is only reclaimed by \ref release.
+    inline void deallocate(void*, size_t,
+        size_t = alignof(std::max_align_t)) {
+    }
+
+    /// \brief Frees all chunks at once.
+    ///
+    /// All memory allocated from the arena becomes invalid. The statistics
+    /// are kept.
+    inline void release() {
+        while(m_chunks) {
+            chunk_t* next = m_chunks->next;
+            free(m_chunks);
+            m_chunks = next;
+        }
+        m_pos = 0;
+        m_end = 0;
+    }
+
+    /// \brief The total amount of bytes allocated from the arena.
+    inline size_t allocated() const {
+        return m_allocated;
+    }
+
+    /// \brief The total number of chunks allocated by the arena.
+    inline size_t num_chunks() const {
+        return m_num_chunks;
+    }
+
+#ifdef TDC_STAT_ARENA_PMR
+protected:
+    virtual void* do_allocate(size_t bytes, size_t alignment) override {
+        return allocate(bytes, alignment);
+    }
+
+    virtual void do_deallocate(void*, size_t, size_t) override {
+    }
+
+    virtual bool do_is_equal(
+        const std::pmr::memory_resource& other) const noexcept override {
+
+        return this == &other;
+    }
+#endif
+};
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension reporting the I/O of the process during a phase.
+///
+/// The counters in \c /proc/self/io are read when a phase starts and
+/// whenever it is written. The differences are written as the \c processIO
+/// statistic: the bytes read and written through system calls (\c rchar,
+/// \c wchar, which include the page cache, pipes and terminals), the number
+/// of read and write system calls and the bytes actually fetched from and
+/// sent to the storage layer (\c read_bytes, \c write_bytes). Furthermore,
+/// the read and write rates in MB/s are reported, relative to the time the
+/// phase was running without being paused, like \c timeRun.
+///
+/// The reads of \c /proc/self/io by this extension are not included. If
+/// other threads read the counters at the same time, a read of theirs may
+/// still be included.
+///
+/// If \c /proc/self/io cannot be read, e.g., because the kernel lacks task
+/// I/O accounting, nothing is written.
+///
+/// Register using \ref StatPhase::register_extension.
+class ProcessIO : public StatPhaseExtension {
+public:
+    /// \brief The counters of \c /proc/self/io.
+    struct counters_t {
+        uint64_t rchar, wchar, syscr, syscw, read_bytes, write_bytes;
+    };
+
+    /// \brief Reads the current counters of the process, excluding the
+    ///        reads of the counters themselves.
+    /// \return whether the counters could be read
+    static bool read_counters(counters_t& counters);
+
+private:
+    bool m_valid;
+    counters_t m_start;
+
+    uint64_t m_start_time;
+    uint64_t m_pause_time;
+    uint64_t m_paused = 0;
+
+public:
+    ProcessIO();
+
+    virtual void pause() override;
+    virtual void resume() override;
+    virtual void propagate(const StatPhaseExtension& ext) override;
+    virtual void write(json& data) override;
+};
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <sys/resource.h>
+
+#include <tudocomp_stat/StatPhaseExtension.hpp>
+
+namespace tdc {
+
+/// \brief Extension reporting the operating system resources used by a
+///        phase.
+///
+/// A snapshot of \c getrusage is taken when a phase starts and compared to
+/// one taken whenever the phase is written. The differences are written as
+/// the \c resourceUsage statistic: the minor and major page faults, the
+/// voluntary and involuntary context switches, the user and system CPU time
+/// in milliseconds, the maximum resident set size in bytes and how much it
+/// grew during the phase.
+///
+/// Minor page faults include the first touch of freshly allocated memory,
+/// which is easily overlooked as it is not part of any allocation.
+///
+/// By default, the usage of the whole process is measured. Since the
+/// measurement runs through sub phases, they are already included in their
+/// parent phase.
+///
+/// Register using \ref StatPhase::register_extension.
+class ResourceUsage : public StatPhaseExtension {
+private:
+    inline static std::atomic<bool>& default_thread_only() {
+        static std::atomic<bool> thread_only(false);
+        return thread_only;
+    }
+
+    bool m_thread_only;
+    rusage m_start;
+
+    inline static double millis(const timeval& t) {
+        return double(t.tv_sec) * 1000.0 + double(t.tv_usec) / 1000.0;
+    }
+
+    inline void snapshot(rusage& usage) const {
+#ifdef RUSAGE_THREAD
+        getrusage(m_thread_only ? RUSAGE_THREAD : RUSAGE_SELF, &usage);
+#else
+        getrusage(RUSAGE_SELF, &usage);
+#endif
+    }
+
+public:
+    /// \brief Sets whether only the thread starting a phase is measured
+    ///        rather than the whole process, for phases started hereafter.
+    ///
+    /// The thread measured is the one writing the phase, which is usually
+    /// the one that started it. The maximum resident set size always refers
+    /// to the process.
+    inline static void set_thread_only(bool thread_only) {
+        default_thread_only() = thread_only;
+    }
+
+    inline ResourceUsage() : m_thread_only(default_thread_only()) {
+        snapshot(m_start);
+    }
+
+    virtual void write(json& data) override {
+        rusage end;
+        snapshot(end);
+
+        data["resourceUsage"] = json({
+            {"minorFaults", end.ru_minflt - m_start.ru_minflt},
+            {"majorFaults", end.ru_majflt - m_start.ru_majflt},
+            {"voluntarySwitches", end.ru_nvcsw - m_start.ru_nvcsw},
+            {"involuntarySwitches", end.ru_nivcsw - m_start.ru_nivcsw},
+            {"userTime", millis(end.ru_utime) - millis(m_start.ru_utime)},
+            {"systemTime", millis(end.ru_stime) - millis(m_start.ru_stime)},
+            // reported in kilobytes by Linux
+            {"maxRss", int64_t(end.ru_maxrss) * 1024},
+            {"maxRssGrowth",
+                int64_t(end.ru_maxrss - m_start.ru_maxrss) * 1024},
+        });
+    }
+};
+
+}
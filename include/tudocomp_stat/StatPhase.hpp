@@ -1,15 +1,25 @@
 #pragma once
 
+#include <atomic>
+#include <cmath>
 #include <cstring>
 #include <ctime>
+#include <functional>
+#include <limits>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
 
 #include <tudocomp_stat/json.hpp>
 
 #ifndef STATS_DISABLED
 
+#include <tudocomp_stat/MallocBackend.hpp>
+#include <tudocomp_stat/PhaseArena.hpp>
 #include <tudocomp_stat/StatPhaseExtension.hpp>
+#include <tudocomp_stat/TscClock.hpp>
 
 #include <time.h>
 #include <sys/time.h>
@@ -44,13 +54,41 @@ inline void get_monotonic_time(struct timespec *ts){
 /// of the application. The measured data can be printed as a JSON string for
 /// use in the tudocomp charter for visualization or third party applications.
 class StatPhase {
+public:
+    /// \brief Calls of allocation functions, which are counted per phase.
+    enum alloc_call_t {
+        CALL_MALLOC, CALL_FREE, CALL_REALLOC, CALL_CALLOC, NUM_ALLOC_CALLS
+    };
+
+    /// \brief What happens when a phase exceeds its memory budget.
+    enum budget_action_t {
+        /// \brief Log a warning to the standard error and continue.
+        BUDGET_LOG,
+        /// \brief Invoke the callback passed to \ref set_budget.
+        BUDGET_CALLBACK,
+        /// \brief Refuse the allocation, i.e., \c malloc returns \c NULL.
+        BUDGET_FAIL
+    };
+
+    /// \brief The clocks phases can be timed with.
+    enum time_source_t {
+        /// \brief \c clock_gettime with \c CLOCK_MONOTONIC.
+        TIME_MONOTONIC,
+        /// \brief The invariant time stamp counter, see \ref TscClock.
+        TIME_TSC
+    };
+
 private:
     //////////////////////////////////////////
     // Memory tracking
     //////////////////////////////////////////
 
-    static uint16_t s_suppress_memory_tracking_state;
-    static uint16_t s_suppress_tracking_user_state;
+    static thread_local uint16_t s_suppress_memory_tracking_state;
+    static std::atomic<uint16_t> s_suppress_tracking_user_state;
+
+    // the user's suppression by the calling thread, which pauses the phase
+    // running within that thread
+    static thread_local uint16_t s_suppress_tracking_thread_state;
 
     static bool s_init;
     static void force_malloc_override_link();
@@ -70,14 +108,18 @@ private:
 
     struct suppress_tracking_user {
         inline static void inc() {
-            if(s_suppress_tracking_user_state++ == 0) {
-                if(s_current) s_current->on_pause_tracking();
+            ++s_suppress_tracking_user_state;
+            if(s_suppress_tracking_thread_state++ == 0) {
+                StatPhase* current = innermost_of_thread();
+                if(current) current->on_pause_tracking();
             }
         }
         inline static void dec() {
-            if(s_suppress_tracking_user_state == 1) {
-                if(s_current) s_current->on_resume_tracking();
+            if(s_suppress_tracking_thread_state == 1) {
+                StatPhase* current = innermost_of_thread();
+                if(current) current->on_resume_tracking();
             }
+            --s_suppress_tracking_thread_state;
             --s_suppress_tracking_user_state;
         }
 
@@ -95,26 +137,89 @@ private:
         }
     };
 
-    inline bool currently_tracking_memory() {
+    inline static bool currently_tracking_memory() {
         return !suppress_memory_tracking::is_paused()
             && !suppress_tracking_user::is_paused();
     }
 
-    inline void track_alloc_internal(size_t bytes) {
-        if(currently_tracking_memory()) {
-            m_mem.current += bytes;
-            m_mem.peak = std::max(m_mem.peak, m_mem.current);
-            if(m_parent) m_parent->track_alloc_internal(bytes);
+    // Allocations are only tracked for the innermost phase, so the cost
+    // does not depend on the nesting depth. Parent phases receive the data
+    // of their sub phases when those finish (see finish and mem_status).
+    //
+    // Both may be called concurrently by the owning thread and by other
+    // threads publishing their buffers, hence the atomic updates.
+    //
+    // The budget is checked here as well. Only single allocations of the
+    // thread owning the phase can be refused, not published buffers.
+    inline bool track_alloc_internal(size_t bytes, bool refusable = false) {
+        const ssize_t current =
+            m_mem.current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+        if(current > m_budget_limit.load(std::memory_order_relaxed) &&
+           !exceed_budget() && refusable) {
+            m_mem.current.fetch_sub(bytes, std::memory_order_relaxed);
+            return false;
         }
+
+        raise_peak(current);
+        return true;
     }
 
     inline void track_free_internal(size_t bytes) {
-        if(currently_tracking_memory()) {
-            m_mem.current -= bytes;
-            if(m_parent) m_parent->track_free_internal(bytes);
+        m_mem.current.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    inline void raise_peak(ssize_t value) {
+        ssize_t peak = m_mem.peak.load(std::memory_order_relaxed);
+        while(value > peak && !m_mem.peak.compare_exchange_weak(
+            peak, value, std::memory_order_relaxed)) {
         }
     }
 
+    inline bool track_internal(ssize_t delta, bool refusable = false) {
+        if(delta > 0) {
+            return track_alloc_internal(delta, refusable);
+        } else if(delta < 0) {
+            track_free_internal(-delta);
+        }
+        return true;
+    }
+
+    inline void track_calls_internal(const size_t* calls) {
+        for(size_t i = 0; i < NUM_ALLOC_CALLS; i++) {
+            if(calls[i]) {
+                m_calls[i].fetch_add(calls[i], std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Accounts a signed amount of bytes for the calling thread, returns
+    // false if the allocation is refused.
+    static bool track_delta(ssize_t delta);
+
+    // Handles an allocation exceeding the budget, returns false if it is to
+    // be refused.
+    bool exceed_budget();
+
+    struct budget_t;
+    static void count_refusing_budget(const budget_t* budget, int delta);
+
+    // Publishes the buffered allocations of all threads to the current
+    // phase. Must be called by the thread owning the current phase.
+    static void drain_thread_buffers();
+
+    // Blocks until no other thread is publishing to a phase anymore.
+    static void await_publishers();
+
+    // Registers or unregisters the calling thread as owner of a phase.
+    static void enter_owner();
+    static void leave_owner();
+
+    static void on_thread_exit(void* buffer);
+
+    // Accounts a signed amount of mapped bytes for the current phase.
+    static void track_mapped(ssize_t delta);
+
     //////////////////////////////////////////
     // Extensions
     //////////////////////////////////////////
@@ -122,14 +227,52 @@ private:
     using ext_ptr_t = std::unique_ptr<StatPhaseExtension>;
     static std::vector<std::function<ext_ptr_t()>> m_extension_registry;
 
+    // indices of the registered extensions receiving allocation events
+    static std::vector<size_t> m_alloc_listener_registry;
+
+    // Notifies the extensions of the current phase of an allocation event.
+    template<typename F>
+    static void notify(F func);
+
+    // Whether an extension overrides any of the allocation event handlers,
+    // which changes the class of the member pointer.
+    template<typename E>
+    static constexpr bool listens_to_allocations() {
+        using base = StatPhaseExtension;
+        return
+            !std::is_same<decltype(&E::on_alloc),
+                          decltype(&base::on_alloc)>::value ||
+            !std::is_same<decltype(&E::on_free),
+                          decltype(&base::on_free)>::value ||
+            !std::is_same<decltype(&E::on_lifetime),
+                          decltype(&base::on_lifetime)>::value ||
+            !std::is_same<decltype(&E::on_block_alloc),
+                          decltype(&base::on_block_alloc)>::value ||
+            !std::is_same<decltype(&E::on_block_free),
+                          decltype(&base::on_block_free)>::value;
+    }
+
+    // Counts a finished phase, see track_lifetime.
+    static void count_finished_phase();
+
 public:
+    /// \brief Registers an extension for all phases started hereafter.
+    ///
+    /// If the extension overrides any of the allocation event handlers of
+    /// \ref StatPhaseExtension (e.g., \ref StatPhaseExtension::on_alloc),
+    /// it will receive the allocation events of its phase.
     template<typename E>
     static inline void register_extension() {
-        if(s_current != nullptr) {
+        if(in_measurement()) {
             throw std::runtime_error(
                 "Extensions must be registered outside of any "
                 "stat measurements!");
         } else {
+            if(listens_to_allocations<E>()) {
+                m_alloc_listener_registry.push_back(
+                    m_extension_registry.size());
+            }
+
             m_extension_registry.emplace_back([](){
                 return std::make_unique<E>();
             });
@@ -138,37 +281,180 @@ public:
 
 private:
     std::unique_ptr<std::vector<ext_ptr_t>> m_extensions;
+    std::unique_ptr<std::vector<StatPhaseExtension*>> m_alloc_listeners;
 
     //////////////////////////////////////////
     // Other StatPhase state
     //////////////////////////////////////////
 
-    static StatPhase* s_current;
+    static std::atomic<StatPhase*> s_current;
     StatPhase* m_parent = nullptr;
 
+    // Threads that do not own the current phase keep a stack of their own
+    // phases (worker phases), which track the thread's allocations directly.
+    // Its top-level phases can be attached to a phase of another thread,
+    // which merges them once they are finished (see attach_thread).
+    static thread_local StatPhase* s_thread_current;
+    static thread_local StatPhase* s_thread_attach;
+    static thread_local size_t s_thread_index;
+
+    static constexpr size_t no_thread = std::numeric_limits<size_t>::max();
+
+    bool m_worker = false;
+    size_t m_thread_index = no_thread; // if attached
+
+    // A finished top-level phase of an attached thread.
+    struct thread_phase_t {
+        size_t index;
+        ssize_t peak; // including the offset
+        ssize_t current, mapped;
+        size_t calls[NUM_ALLOC_CALLS];
+        size_t budget_exceeded;
+        std::unique_ptr<std::vector<ext_ptr_t>> extensions;
+        json data;
+    };
+
+    std::mutex m_thread_mutex;
+    std::vector<thread_phase_t> m_thread_phases;
+
+    // Whether the calling thread owns the current phase.
+    static bool owns_current_phase();
+
+    // Merges the finished phases of attached threads in order of their
+    // index. Must be called by the thread owning this phase.
+    inline void merge_thread_phases() {
+        std::vector<thread_phase_t> phases;
+        {
+            std::lock_guard<std::mutex> lock(m_thread_mutex);
+            phases.swap(m_thread_phases);
+        }
+        std::stable_sort(phases.begin(), phases.end(),
+            [](const thread_phase_t& a, const thread_phase_t& b){
+                return a.index < b.index;
+            });
+
+        for(auto& p : phases) {
+            raise_peak(p.peak);
+            m_mem.current += p.current;
+            m_mem.mapped += p.mapped;
+            track_calls_internal(p.calls);
+            m_budget_exceeded += p.budget_exceeded;
+
+            for(size_t i = 0; i < m_extensions->size(); i++) {
+                (*m_extensions)[i]->propagate(*(*p.extensions)[i]);
+            }
+            m_sub->push_back(std::move(p.data));
+        }
+    }
+
+    // The innermost phase of the given kind for the calling thread.
+    inline static StatPhase* innermost(bool worker) {
+        return worker ? s_thread_current : s_current.load();
+    }
+
+    // The innermost phase running within the calling thread, which is the
+    // current phase unless the thread runs worker phases.
+    inline static StatPhase* innermost_of_thread() {
+        return s_thread_current ? s_thread_current : s_current.load();
+    }
+
+    // Whether a phase is running, either the current phase or a worker
+    // phase of the calling thread.
+    inline static bool in_measurement() {
+        return s_thread_current || s_current.load();
+    }
+
     double m_pause_time;
 
     struct {
         double start, end, paused;
+
+        // CPU time of the process and of the thread owning the phase
+        double cpu_start, cpu_end;
+        double thread_cpu_start, thread_cpu_end;
     } m_time;
 
     struct {
-        ssize_t off, current, peak;
+        ssize_t off;
+        std::atomic<ssize_t> current, peak;
+        std::atomic<ssize_t> mapped;
     } m_mem;
 
+    // counted like the memory, i.e., only for the innermost phase
+    std::atomic<size_t> m_calls[NUM_ALLOC_CALLS];
+
     std::string m_title;
     std::unique_ptr<json> m_sub;
     std::unique_ptr<json> m_stats;
 
+    // The budget limiting this phase (its own or one of an ancestor), and
+    // the amount of bytes this phase may allocate until it is exceeded.
+    struct budget_t {
+        size_t bytes;
+        budget_action_t action;
+        std::function<void(StatPhase&)> callback;
+    };
+
+    std::unique_ptr<budget_t> m_own_budget;
+    const budget_t* m_budget = nullptr;
+    std::atomic<ssize_t> m_budget_limit {
+        std::numeric_limits<ssize_t>::max() };
+    std::atomic<size_t> m_budget_exceeded {0};
+
+    // the number of running sub phases, which refer to the budget
+    std::atomic<size_t> m_running_subs {0};
+
+    // Determines the budget limiting this phase. An inherited budget is
+    // reduced by what the parent had allocated when this phase started.
+    inline void update_budget() {
+        m_budget = nullptr;
+        m_budget_limit = std::numeric_limits<ssize_t>::max();
+
+        if(m_parent && m_parent->m_budget) {
+            m_budget = m_parent->m_budget;
+            m_budget_limit = m_parent->m_budget_limit - m_mem.off;
+        }
+        if(m_own_budget && ssize_t(m_own_budget->bytes) <= m_budget_limit) {
+            m_budget = m_own_budget.get();
+            m_budget_limit = ssize_t(m_own_budget->bytes);
+        }
+    }
+
+    // created on first use, see arena
+    std::unique_ptr<PhaseArena> m_arena;
+    static size_t s_arena_chunk_size;
+    static bool s_arena_huge_pages;
+
     bool m_disabled = false;
 
+    // used instead of clock_gettime if selected, see set_time_source
+    static TscClock s_tsc;
+    static bool s_use_tsc;
+
     inline static double current_time_millis() {
+        if(s_use_tsc) return s_tsc.millis();
+
         timespec t;
         get_monotonic_time(&t);
 
         return double(t.tv_sec * 1000L) + double(t.tv_nsec) / double(1000000L);
     }
 
+    inline static double cpu_time_millis(clockid_t clock) {
+        timespec t;
+        if(clock_gettime(clock, &t) != 0) return 0;
+
+        return double(t.tv_sec * 1000L) + double(t.tv_nsec) / double(1000000L);
+    }
+
+    inline void record_end_time() {
+        // reversed order of init, so the thread's interval lies within
+        // that of the process
+        m_time.end = current_time_millis();
+        m_time.thread_cpu_end = cpu_time_millis(CLOCK_THREAD_CPUTIME_ID);
+        m_time.cpu_end = cpu_time_millis(CLOCK_PROCESS_CPUTIME_ID);
+    }
+
     inline void init(std::string&& title) {
         suppress_memory_tracking guard;
 
@@ -177,7 +463,17 @@ private:
             s_init = true;
         }
 
-        m_parent = s_current;
+        // threads other than the one owning the current phase start worker
+        // phases, so they cannot interfere with the phases of that thread
+        m_worker = s_thread_current || s_thread_attach ||
+            (s_current.load() && !owns_current_phase());
+        if(m_worker) {
+            m_parent = s_thread_current ? s_thread_current : s_thread_attach;
+            m_thread_index = (s_thread_current || !s_thread_attach)
+                ? no_thread : s_thread_index;
+        } else {
+            m_parent = s_current.load();
+        }
 
         m_title = std::move(title);
 
@@ -191,31 +487,102 @@ private:
             m_extensions->emplace_back(ctor());
         }
 
+        m_alloc_listeners =
+            std::make_unique<std::vector<StatPhaseExtension*>>();
+        for(size_t i : m_alloc_listener_registry) {
+            m_alloc_listeners->push_back((*m_extensions)[i].get());
+        }
+
+        // attribute what other threads buffered so far to the parent
+        if(!m_worker) {
+            enter_owner();
+            drain_thread_buffers();
+        }
+
         // initialize basic data as the very last thing
-        m_mem.off = m_parent ? m_parent->m_mem.current : 0;
+        m_mem.off = m_parent ? m_parent->m_mem.current.load() : 0;
         m_mem.current = 0;
         m_mem.peak = 0;
+        m_mem.mapped = 0;
+        for(auto& c : m_calls) c = 0;
+
+        update_budget();
+        m_budget_exceeded = 0;
+        if(m_parent) m_parent->m_running_subs++;
 
         m_time.end = 0;
-        m_time.start = current_time_millis();
         m_time.paused = 0;
+        m_time.cpu_start = cpu_time_millis(CLOCK_PROCESS_CPUTIME_ID);
+        m_time.thread_cpu_start = cpu_time_millis(CLOCK_THREAD_CPUTIME_ID);
+        m_time.start = current_time_millis();
 
         // set as current
-        s_current = this;
+        if(m_worker) {
+            s_thread_current = this;
+        } else {
+            s_current = this;
+        }
     }
 
     /// Finish the current Phase
     inline void finish() {
+        // free the arena's chunks while they are still tracked
+        if(m_arena) m_arena->release();
+
         suppress_memory_tracking guard;
 
-        m_time.end = current_time_millis();
+        // collect what other threads buffered during this phase
+        merge_thread_phases();
+        drain_thread_buffers();
+
+        record_end_time();
+
+        if(m_worker) {
+            // pop parent, unless it belongs to another thread
+            s_thread_current = (m_thread_index == no_thread) ? m_parent
+                                                             : nullptr;
+        } else {
+            // pop parent and wait for threads still publishing to this phase
+            s_current = m_parent;
+            leave_owner();
+            await_publishers();
+        }
+        count_finished_phase();
 
-        // let extensions write data
+        // let extensions end measurement on this thread, then write data
+        for(auto& ext : *m_extensions) {
+            ext->finish();
+        }
         for(auto& ext : *m_extensions) {
             ext->write(*m_stats);
         }
 
-        if(m_parent) {
+        if(m_parent && m_thread_index != no_thread) {
+            // the parent is owned by another thread, which merges this
+            // phase later
+            thread_phase_t p;
+            p.index = m_thread_index;
+            p.peak = m_mem.off + m_mem.peak;
+            p.current = m_mem.current;
+            p.mapped = m_mem.mapped;
+            for(size_t i = 0; i < NUM_ALLOC_CALLS; i++) p.calls[i] = m_calls[i];
+            p.budget_exceeded = m_budget_exceeded;
+            p.data = to_json();
+            p.extensions = std::move(m_extensions);
+
+            std::lock_guard<std::mutex> lock(m_parent->m_thread_mutex);
+            m_parent->m_thread_phases.push_back(std::move(p));
+        } else if(m_parent) {
+            // while this phase was running, the parent's memory was at
+            // offset m_mem.off plus the memory of this phase
+            m_parent->raise_peak(m_mem.off + m_mem.peak);
+            m_parent->m_mem.current += m_mem.current;
+            m_parent->m_mem.mapped += m_mem.mapped;
+            for(size_t i = 0; i < NUM_ALLOC_CALLS; i++) {
+                m_parent->m_calls[i] += m_calls[i];
+            }
+            m_parent->m_budget_exceeded += m_budget_exceeded;
+
             // propagate extensions to parent
             for(size_t i = 0; i < m_extensions->size(); i++) {
                 (*(m_parent->m_extensions))[i]->propagate(*(*m_extensions)[i]);
@@ -225,14 +592,66 @@ private:
             m_parent->m_time.paused += m_time.paused;
             m_parent->m_sub->push_back(to_json());
         }
+        if(m_parent) m_parent->m_running_subs--;
 
         // managed release of complex members
-        m_extensions.release();
+        m_arena.reset();
+        m_extensions.reset();
+        m_alloc_listeners.reset();
         m_sub.release();
         m_stats.release();
+    }
 
-        // pop parent
-        s_current = m_parent;
+    // Determines the current and peak memory of this phase, including the
+    // data of sub phases that are still running.
+    inline void mem_status(
+        ssize_t& current, ssize_t& peak, ssize_t& mapped) const {
+
+        current = 0;
+        peak = 0;
+        mapped = 0;
+
+        ssize_t off = 0;
+        for(const StatPhase* p = innermost(m_worker); p; p = p->m_parent) {
+            current += p->m_mem.current;
+            mapped += p->m_mem.mapped;
+            peak = std::max(ssize_t(p->m_mem.peak), off + peak);
+            off = p->m_mem.off;
+
+            if(p == this) return;
+        }
+
+        // not running anymore
+        current = m_mem.current;
+        peak = m_mem.peak;
+        mapped = m_mem.mapped;
+    }
+
+    // Determines the number of allocation function calls of this phase,
+    // including those of sub phases that are still running.
+    inline void call_status(size_t* calls) const {
+        for(size_t i = 0; i < NUM_ALLOC_CALLS; i++) calls[i] = 0;
+
+        for(const StatPhase* p = innermost(m_worker); p; p = p->m_parent) {
+            for(size_t i = 0; i < NUM_ALLOC_CALLS; i++) {
+                calls[i] += p->m_calls[i];
+            }
+            if(p == this) return;
+        }
+
+        // not running anymore
+        for(size_t i = 0; i < NUM_ALLOC_CALLS; i++) calls[i] = m_calls[i];
+    }
+
+    // An estimated amount of bytes consists of the weights w of the sampled
+    // blocks alive. The variance of a single weight is w * (w - s) <= w * R
+    // for a block of size s and sample interval R. Thus, the variance of an
+    // estimate X is bounded by X * R and we report two standard deviations.
+    //
+    // This neglects frees of blocks allocated before the phase, which add to
+    // the variance, but not to the estimate.
+    inline static double sample_error(ssize_t bytes, size_t interval) {
+        return 2.0 * std::sqrt(double(std::abs(bytes)) * double(interval));
     }
 
     inline void on_pause_tracking() {
@@ -301,9 +720,25 @@ public:
     ///
     /// \param bytes the amount of allocated bytes to track for the current
     ///              phase
-    inline static void track_alloc(size_t bytes) {
-        if(s_current) s_current->track_alloc_internal(bytes);
-    }
+    ///
+    /// This may be called from any thread. Threads that do not own the
+    /// current phase account their allocations in a thread-local buffer,
+    /// see \ref set_thread_buffer_size.
+    ///
+    /// \return \c false if the allocation is refused, because it exceeds a
+    ///         memory budget (see \ref set_budget)
+    static bool track_alloc(size_t bytes);
+
+    /// \brief Tracks a sampled memory allocation for the current phase.
+    ///
+    /// The allocation is tracked with its weight, i.e., the amount of bytes
+    /// it stands for, whereas extensions also receive its actual size (see
+    /// \ref StatPhaseExtension::on_alloc).
+    ///
+    /// \param bytes  the amount of allocated bytes
+    /// \param weight the amount of bytes to track for the current phase
+    /// \return \c false if the allocation is refused
+    static bool track_alloc(size_t bytes, size_t weight);
 
     /// \brief Tracks a memory deallocation of the given size for the current
     ///        phase.
@@ -313,8 +748,221 @@ public:
     /// direct kernel allocations like memory mappings).
     ///
     /// \param bytes the amount of freed bytes to track for the current phase
-    inline static void track_free(size_t bytes) {
-        if(s_current) s_current->track_free_internal(bytes);
+    static void track_free(size_t bytes);
+
+    /// \brief Counts a call of an allocation function for the current phase.
+    ///
+    /// This is done automatically by the malloc override, use it only to
+    /// count calls of other allocators. Like allocations, calls of threads
+    /// that do not own the current phase are buffered.
+    ///
+    /// \param call the kind of the call
+    static void track_call(alloc_call_t call);
+
+    /// \brief Reports the lifetime of a freed block to the extensions of
+    ///        the current phase.
+    ///
+    /// The malloc override does this automatically for blocks allocated
+    /// while timestamps are recorded, which is the case as soon as an
+    /// extension requesting them (e.g., \ref AllocLifetimes) has been
+    /// instantiated. Timestamps are not available if the malloc override is
+    /// headerless.
+    ///
+    /// \param nanoseconds the time since the block was allocated
+    /// \param phases      the number of phases that finished in that time
+    static void track_lifetime(uint64_t nanoseconds, size_t phases);
+
+    /// \brief Reports an allocated block to the extensions of the current
+    ///        phase.
+    ///
+    /// The malloc override does this automatically as soon as an extension
+    /// requesting block addresses (e.g., \ref LiveAllocations) has been
+    /// instantiated.
+    ///
+    /// \param ptr   the address of the block
+    /// \param bytes the size of the block
+    static void track_block_alloc(const void* ptr, size_t bytes);
+
+    /// \brief Reports a block that is being freed to the extensions of the
+    ///        current phase.
+    ///
+    /// Unlike other events, this is also reported while tracking is
+    /// suppressed using \ref suppress_tracking.
+    ///
+    /// \param ptr the address of the block
+    static void track_block_free(const void* ptr);
+
+    /// \brief Tracks an anonymous memory mapping for the current phase.
+    ///
+    /// The mapped bytes count as allocated memory and are additionally
+    /// reported as \c memMapped. This is done automatically for mappings
+    /// created using \c mmap or \c mremap, use it only for mappings created
+    /// by other means (e.g., direct system calls).
+    ///
+    /// Mapped ranges are remembered, so unmapping is accounted correctly
+    /// regardless of what part of a mapping is released.
+    ///
+    /// \param addr   the start address of the mapping
+    /// \param length the length of the mapping in bytes
+    static void track_map(const void* addr, size_t length);
+
+    /// \brief Tracks the removal of a memory mapping for the current phase.
+    ///
+    /// Only the parts of the given range that have previously been tracked
+    /// using \ref track_map are accounted.
+    ///
+    /// \param addr   the start address of the range
+    /// \param length the length of the range in bytes
+    /// \return the amount of tracked bytes that were unmapped
+    static size_t track_unmap(const void* addr, size_t length);
+
+    /// \brief Sets the accounting granularity for threads that do not own
+    ///        the current phase.
+    ///
+    /// Allocations of such threads are accumulated in a thread-local buffer
+    /// and only published to the current phase once the buffered amount
+    /// reaches the given number of bytes, or when a phase begins or ends.
+    /// Thus, peaks may be underestimated by at most this amount per thread,
+    /// whereas final amounts are always exact.
+    ///
+    /// \param bytes the buffer size in bytes, zero publishes every single
+    ///              allocation immediately
+    static void set_thread_buffer_size(size_t bytes);
+
+    /// \brief Enables sampling of allocations.
+    ///
+    /// Instead of tracking every single allocation, allocated bytes are
+    /// sampled like a Poisson process with the given mean interval. Sampled
+    /// allocations are tracked with a weight so that the reported amounts are
+    /// unbiased estimates, which are then accompanied by error bounds in the
+    /// JSON output. This greatly reduces the cost of tracking for phases
+    /// with many small allocations.
+    ///
+    /// The interval must be set outside of any stat measurements. Sampling
+    /// is not available if the malloc override is headerless.
+    ///
+    /// \param bytes the mean interval in bytes, zero tracks every allocation
+    static void set_sample_interval(size_t bytes);
+
+    /// \brief Returns the current sample interval, zero if every allocation
+    ///        is tracked.
+    static size_t sample_interval();
+
+    /// \brief Selects the allocator underlying the malloc override.
+    ///
+    /// Blocks allocated afterwards are allocated by the given backend, blocks
+    /// allocated before are still released by the backend that allocated
+    /// them. Besides glibc, only one other backend may be selected during
+    /// the lifetime of the process. This allows to compare allocators within
+    /// the same build.
+    ///
+    /// The backend must be selected outside of any stat measurements.
+    /// Backends other than glibc are not available if the malloc override
+    /// is headerless.
+    ///
+    /// \param backend the backend, e.g., \ref size_class_backend
+    static void set_malloc_backend(const MallocBackend& backend);
+
+    /// \brief Returns the allocator underlying the malloc override.
+    static const MallocBackend& malloc_backend();
+
+    /// \brief Configures the arenas of phases started hereafter.
+    ///
+    /// The options must be set outside of any stat measurements.
+    ///
+    /// \param chunk_size the minimum size of the arena's chunks in bytes
+    /// \param huge_pages whether chunks are backed by huge pages, if
+    ///                   supported by the system
+    static void set_arena_options(size_t chunk_size, bool huge_pages = false);
+
+    /// \brief Selects the clock used to time phases started hereafter.
+    ///
+    /// The time stamp counter is considerably cheaper to read, which matters
+    /// for many short phases. When it is selected, it is calibrated against
+    /// \c CLOCK_MONOTONIC, which takes about ten milliseconds. If the counter
+    /// is not invariant or the calibration fails, the monotonic clock is kept.
+    ///
+    /// The clock must be selected outside of any stat measurements.
+    ///
+    /// \param source the clock
+    /// \return whether the clock is used, false if the monotonic clock
+    ///         is used instead
+    static bool set_time_source(time_source_t source);
+
+    /// \brief Returns the clock used to time phases.
+    inline static time_source_t time_source() {
+        return s_use_tsc ? TIME_TSC : TIME_MONOTONIC;
+    }
+
+    /// \brief Guard attaching the phases of a thread to a phase of another
+    ///        thread, see \ref attach_thread.
+    class thread_attachment {
+    private:
+        StatPhase* m_prev_parent;
+        size_t m_prev_index;
+        bool m_active = true;
+
+    public:
+        inline thread_attachment(StatPhase& parent, size_t index)
+            : m_prev_parent(s_thread_attach), m_prev_index(s_thread_index) {
+            s_thread_attach = &parent;
+            s_thread_index = index;
+        }
+
+        inline thread_attachment(thread_attachment&& other)
+            : m_prev_parent(other.m_prev_parent),
+              m_prev_index(other.m_prev_index) {
+            other.m_active = false;
+        }
+
+        thread_attachment(const thread_attachment&) = delete;
+
+        inline ~thread_attachment() {
+            if(m_active) {
+                s_thread_attach = m_prev_parent;
+                s_thread_index = m_prev_index;
+            }
+        }
+    };
+
+    /// \brief Attaches the phases started by the calling thread to a phase
+    ///        of another thread as long as the returned guard exists.
+    ///
+    /// A thread that does not own the current phase keeps a stack of phases
+    /// of its own, which track the thread's allocations and do not interfere
+    /// with the phases of other threads. Its top-level phases become sub
+    /// phases of the given parent phase. They are merged into the parent
+    /// in the order of the given thread index when the parent ends or is
+    /// converted to JSON after the thread has finished them, so joining all
+    /// threads beforehand yields the same tree regardless of scheduling.
+    /// Their JSON contains the index as \c thread.
+    ///
+    /// The parent must not end before the attached phases have finished.
+    /// While they are running, the parent does not see their memory, and its
+    /// peak includes theirs only as if they had run one after another.
+    ///
+    /// Without attaching, the phases of such a thread have no parent.
+    ///
+    /// \param parent the parent phase, usually the current phase of the
+    ///               thread spawning the calling thread
+    /// \param index  the index of the calling thread, e.g., the index of an
+    ///               OpenMP thread, which determines the order of merging
+    inline static thread_attachment attach_thread(StatPhase& parent,
+        size_t index) {
+
+        return thread_attachment(parent, index);
+    }
+
+    /// \brief Returns the arena of the current phase.
+    ///
+    /// \see arena
+    inline static PhaseArena& current_arena() {
+        StatPhase* current = innermost_of_thread();
+        if(!current) {
+            throw std::runtime_error(
+                "The current arena requires a running stat measurement!");
+        }
+        return current->arena();
     }
 
     /// \brief Pauses the tracking of memory allocations in the current phase.
@@ -338,7 +986,8 @@ public:
     /// \brief Creates a guard that suppresses tracking as long as it exists.
     ///
     /// This should be used during more complex logging activity in order
-    /// for it to not count against memory measures.
+    /// for it to not count against memory measures. The time is reported
+    /// as paused for the innermost phase running within the calling thread.
     inline static auto suppress_tracking() {
         return suppress_tracking_user();
     }
@@ -361,13 +1010,15 @@ public:
     /// \brief Logs a user statistic for the current phase.
     ///
     /// User statistics will be stored in a special data block for a phase
-    /// and is included in the JSON output.
+    /// and is included in the JSON output. Within a thread running worker
+    /// phases, the statistic is logged for its innermost worker phase.
     ///
     /// \param key the statistic key or name
     /// \param value the value to log (will be converted to a string)
     template<typename T>
     inline static void log(std::string&& key, const T& value) {
-        if(s_current) s_current->log_stat(std::move(key), value);
+        StatPhase* current = innermost_of_thread();
+        if(current) current->log_stat(std::move(key), value);
     }
 
     /// \brief Creates an inert statistics phase without any effect.
@@ -392,6 +1043,10 @@ public:
         if (!m_disabled) {
             finish();
         }
+
+        suppress_memory_tracking guard;
+        count_refusing_budget(m_own_budget.get(), -1);
+        m_own_budget.reset();
     }
 
     /// \brief Starts a new phase as a sibling, reusing the same object.
@@ -406,6 +1061,7 @@ public:
             finish();
             init(std::move(new_title));
             m_mem.off = offs;
+            update_budget();
         }
     }
 
@@ -428,6 +1084,50 @@ public:
         return m_title;
     }
 
+    /// \brief Sets a memory budget for this phase and the sub phases started
+    ///        hereafter.
+    ///
+    /// The budget limits the memory of the phase, i.e., the memory reported
+    /// as \c memFinal. Sub phases inherit what is left of the budget when
+    /// they start, unless they set a tighter one themselves. The budget is
+    /// kept when the phase is split. It cannot be changed while sub phases
+    /// are running.
+    ///
+    /// When an allocation exceeds the budget, the phase logs a warning or
+    /// invokes the callback, but only for the first such allocation. With
+    /// \ref BUDGET_FAIL, every such allocation is refused instead, which
+    /// allows to test out-of-memory handling. This works for allocations
+    /// of the thread owning the phase, whereas other threads are checked
+    /// only when their buffers are published and are never refused. The
+    /// number of allocations exceeding the budget is reported as
+    /// \c memBudgetExceeded.
+    ///
+    /// \param bytes the budget in bytes
+    /// \param action what happens when the budget is exceeded
+    /// \param callback the function invoked with \ref BUDGET_CALLBACK,
+    ///                 which receives the phase exceeding the budget and
+    ///                 may be called from any thread
+    void set_budget(size_t bytes, budget_action_t action = BUDGET_LOG,
+        std::function<void(StatPhase&)> callback = nullptr);
+
+    /// \brief Returns the arena of this phase, creating it on first use.
+    ///
+    /// The arena is meant for temporaries that die with the phase. Its
+    /// chunks are tracked as allocations and are all freed when the phase
+    /// ends or is split. The amount of bytes allocated from the arena and
+    /// the number of its chunks are included in the JSON output as
+    /// \c arenaBytes and \c arenaChunks.
+    ///
+    /// \see set_arena_options
+    inline PhaseArena& arena() {
+        if(!m_arena) {
+            suppress_memory_tracking guard;
+            m_arena = std::make_unique<PhaseArena>(
+                s_arena_chunk_size, s_arena_huge_pages);
+        }
+        return *m_arena;
+    }
+
     /// \brief Constructs the JSON representation of the measured data.
     ///
     /// It contains the subtree of phases beneath this phase.
@@ -436,7 +1136,9 @@ public:
     inline json to_json() {
         suppress_memory_tracking guard;
         if (!m_disabled) {
-            m_time.end = current_time_millis();
+            merge_thread_phases();
+            drain_thread_buffers();
+            record_end_time();
 
             // let extensions write data
             for(auto& ext : *m_extensions) {
@@ -445,6 +1147,7 @@ public:
 
             json obj;
             obj["title"] = m_title;
+            if(m_thread_index != no_thread) obj["thread"] = m_thread_index;
             obj["timeStart"] = m_time.start;
             obj["timeEnd"] = m_time.end;
             obj["timePaused"] = m_time.paused;
@@ -452,9 +1155,49 @@ public:
             const double dt = m_time.end - m_time.start;
             obj["timeDelta"] = dt;
             obj["timeRun"] = dt - m_time.paused;
+
+            // the process CPU time exceeds the wall time if several threads
+            // were busy, so the utilization estimates the parallelism
+            const double cpu = m_time.cpu_end - m_time.cpu_start;
+            obj["timeCpu"] = cpu;
+            obj["timeThreadCpu"] =
+                m_time.thread_cpu_end - m_time.thread_cpu_start;
+            obj["cpuUtilization"] = dt > 0 ? cpu / dt : 0.0;
             obj["memOff"] = m_mem.off;
-            obj["memPeak"] = m_mem.peak;
-            obj["memFinal"] = m_mem.current;
+            ssize_t mem_current, mem_peak, mem_mapped;
+            mem_status(mem_current, mem_peak, mem_mapped);
+            obj["memPeak"] = mem_peak;
+            obj["memFinal"] = mem_current;
+            obj["memMapped"] = mem_mapped;
+
+            size_t calls[NUM_ALLOC_CALLS];
+            call_status(calls);
+            obj["numMalloc"] = calls[CALL_MALLOC];
+            obj["numFree"] = calls[CALL_FREE];
+            obj["numRealloc"] = calls[CALL_REALLOC];
+            obj["numCalloc"] = calls[CALL_CALLOC];
+
+            const double run = dt - m_time.paused;
+            const size_t allocs =
+                calls[CALL_MALLOC] + calls[CALL_REALLOC] + calls[CALL_CALLOC];
+            obj["allocsPerSecond"] = run > 0 ? 1000.0 * allocs / run : 0.0;
+
+            if(m_budget) {
+                obj["memBudget"] = m_budget_limit.load();
+                obj["memBudgetExceeded"] = m_budget_exceeded.load();
+            }
+
+            if(m_arena) {
+                obj["arenaBytes"] = m_arena->allocated();
+                obj["arenaChunks"] = m_arena->num_chunks();
+            }
+
+            const size_t interval = sample_interval();
+            if(interval) {
+                obj["memSampleInterval"] = interval;
+                obj["memPeakError"] = sample_error(mem_peak, interval);
+                obj["memFinalError"] = sample_error(mem_current, interval);
+            }
             obj["sub"] = *m_sub;
 
             /*
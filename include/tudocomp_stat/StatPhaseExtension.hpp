@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <vector>
@@ -14,10 +15,22 @@ namespace tdc {
 /// multiple calls to write may occur.
 class StatPhaseExtension {
 public:
+    /// \brief Ends measurement, when the phase is finished.
+    virtual ~StatPhaseExtension() = default;
+
     /// \brief Writes phase data.
     /// \param data the data object to write to.
     virtual void write(json& data) = 0;
 
+    /// \brief Notifies the extension that its phase is finishing.
+    ///
+    /// This happens within the thread that ran the phase, before the data
+    /// is written. The phase of an attached thread is propagated later
+    /// within the thread owning its parent, so thread-local state must be
+    /// cleaned up here.
+    virtual void finish() {
+    }
+
     /// \brief Propagates the data of a sub phase to this phase.
     /// \param ext the corresponding extension in the sub phase.
     virtual void propagate(const StatPhaseExtension& sub) {
@@ -30,6 +43,63 @@ public:
     /// \brief Notifies the extension that paused tracking is being resumed.
     virtual void resume() {
     }
+
+    /// \brief Notifies the extension of a tracked allocation in its phase.
+    ///
+    /// This is only called if the extension class overrides it, and happens
+    /// within the allocating thread, which is not necessarily the thread
+    /// owning the phase. Thus, implementations must be thread-safe. Memory
+    /// they allocate is not tracked, but allocating for every event adds to
+    /// the cost of tracking.
+    ///
+    /// If allocations are sampled, this is only called for sampled
+    /// allocations, which stand for more bytes than they have.
+    ///
+    /// \param bytes  the amount of allocated bytes
+    /// \param weight the amount of bytes tracked for the allocation, which
+    ///               differs from \p bytes only if it is sampled
+    virtual void on_alloc(size_t bytes, size_t weight) {
+    }
+
+    /// \brief Notifies the extension of a tracked deallocation in its phase.
+    ///
+    /// The same restrictions as for \ref on_alloc apply.
+    ///
+    /// \param bytes the amount of bytes tracked for the freed block, i.e.,
+    ///              its weight if it was sampled
+    virtual void on_free(size_t bytes) {
+    }
+
+    /// \brief Notifies the extension of the lifetime of a block freed in
+    ///        its phase.
+    ///
+    /// This is only called if the extension class overrides it and if
+    /// blocks are timestamped, see \ref StatPhase::track_lifetime. The same
+    /// restrictions as for \ref on_alloc apply.
+    ///
+    /// \param nanoseconds the time since the block was allocated
+    /// \param phases      the number of phases that finished in that time
+    virtual void on_lifetime(uint64_t nanoseconds, size_t phases) {
+    }
+
+    /// \brief Notifies the extension of a block allocated in its phase.
+    ///
+    /// This is only called if the extension class overrides it and if block
+    /// addresses are reported, see \ref StatPhase::track_block_alloc. The
+    /// same restrictions as for \ref on_alloc apply.
+    ///
+    /// \param ptr   the address of the block
+    /// \param bytes the size of the block
+    virtual void on_block_alloc(const void* ptr, size_t bytes) {
+    }
+
+    /// \brief Notifies the extension of a block freed in its phase.
+    ///
+    /// The same restrictions as for \ref on_block_alloc apply.
+    ///
+    /// \param ptr the address of the block
+    virtual void on_block_free(const void* ptr) {
+    }
 };
 
 }
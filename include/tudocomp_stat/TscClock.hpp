@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TDC_STAT_TSC
+#endif
+
+namespace tdc {
+
+/// \brief A clock reading the time stamp counter of x86 processors.
+///
+/// Reading the counter is considerably cheaper than \c clock_gettime. The
+/// counter is converted to milliseconds on the \c CLOCK_MONOTONIC time line
+/// using a rate measured by \ref calibrate. This is only sound if the
+/// counter is invariant, i.e., it runs at a constant rate in all power
+/// states and is synchronized among cores, which \ref calibrate verifies.
+class TscClock {
+private:
+    double m_millis_per_tick = 0;
+    uint64_t m_base_ticks = 0;
+    double m_base_millis = 0;
+    bool m_rdtscp = false;
+
+    inline static double monotonic_millis() {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return double(t.tv_sec) * 1000.0 + double(t.tv_nsec) / 1000000.0;
+    }
+
+    // measures the ticks per millisecond over the given time
+    inline double measure_rate(double millis) const {
+        const double t0 = monotonic_millis();
+        const uint64_t c0 = ticks();
+        double t1;
+        do {
+            t1 = monotonic_millis();
+        } while(t1 - t0 < millis);
+        const uint64_t c1 = ticks();
+        return c1 > c0 ? double(c1 - c0) / (t1 - t0) : 0;
+    }
+
+public:
+    /// \brief Tells whether the processor has an invariant time stamp
+    ///        counter.
+    inline static bool invariant() {
+#ifdef TDC_STAT_TSC
+        unsigned a, b, c, d;
+        if(!__get_cpuid(0x80000007, &a, &b, &c, &d)) return false;
+        return d & (1U << 8);
+#else
+        return false;
+#endif
+    }
+
+    /// \brief Reads the time stamp counter.
+    ///
+    /// If supported, \c rdtscp is used, which waits for preceding
+    /// instructions to finish.
+    inline uint64_t ticks() const {
+#ifdef TDC_STAT_TSC
+        if(m_rdtscp) {
+            unsigned aux;
+            return __rdtscp(&aux);
+        }
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    /// \brief Calibrates the clock against \c CLOCK_MONOTONIC.
+    ///
+    /// The rate of the counter is measured twice, and the clock is only
+    /// usable if both measurements agree.
+    ///
+    /// \param millis the duration of each measurement in milliseconds
+    /// \return whether the counter is invariant and the calibration succeeded
+    inline bool calibrate(double millis = 5) {
+        m_millis_per_tick = 0;
+        if(!invariant()) return false;
+
+#ifdef TDC_STAT_TSC
+        unsigned a, b, c, d;
+        m_rdtscp = __get_cpuid(0x80000001, &a, &b, &c, &d) && (d & (1U << 27));
+#endif
+
+        const double r1 = measure_rate(millis);
+        const double r2 = measure_rate(millis);
+        if(r1 <= 0 || r2 <= 0 || r1 > r2 * 1.01 || r2 > r1 * 1.01) {
+            return false;
+        }
+
+        m_millis_per_tick = 2.0 / (r1 + r2);
+        m_base_millis = monotonic_millis();
+        m_base_ticks = ticks();
+        return true;
+    }
+
+    /// \brief Tells whether the clock has been calibrated successfully.
+    inline bool calibrated() const {
+        return m_millis_per_tick > 0;
+    }
+
+    /// \brief The counter's rate in ticks per millisecond.
+    inline double ticks_per_milli() const {
+        return calibrated() ? 1.0 / m_millis_per_tick : 0;
+    }
+
+    /// \brief Returns the current time in milliseconds.
+    inline double millis() const {
+        return m_base_millis + double(ticks() - m_base_ticks) * m_millis_per_tick;
+    }
+};
+
+}
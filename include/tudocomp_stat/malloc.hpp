@@ -4,15 +4,80 @@
 #define _GNU_SOURCE
 #endif
 
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 
 #ifndef MALLOC_DISABLED
 #ifndef STATS_DISABLED
 
+namespace tdc {
+    struct MallocBackend;
+}
+
 /// \cond INTERNAL
 namespace malloc_callback {
-    void on_alloc(size_t);
+    // tracks a block of the given size with the given amount of bytes,
+    // which differs if it is sampled, returns false if the allocation is
+    // refused (see StatPhase::set_budget)
+    bool on_alloc(size_t size, size_t bytes);
     void on_free(size_t);
+
+    // the number of budgets refusing allocations, while there are any,
+    // realloc must not move blocks before the new ones are tracked
+    extern std::atomic<size_t> refusing_budgets;
+
+    // calls of allocation functions, see tdc::StatPhase::alloc_call_t
+    enum call_t { CALL_MALLOC, CALL_FREE, CALL_REALLOC, CALL_CALLOC };
+    void on_call(call_t);
+
+    // memory mappings, anonymous ones are tracked
+    void on_map(void* addr, size_t length, bool anonymous);
+    void on_unmap(void* addr, size_t length);
+    void on_remap(void* old_addr, size_t old_length,
+                  void* new_addr, size_t new_length);
+
+    // mean distance in bytes between sampled allocations, zero if disabled
+    extern std::atomic<size_t> sample_interval;
+
+    // whether sampling has ever been enabled, so blocks may be sampled
+    extern std::atomic<bool> sampling_used;
+
+    // the amount of bytes a sampled allocation stands for
+    inline size_t sample_weight(size_t size, size_t interval) {
+        return size_t(double(size) /
+            -std::expm1(-double(size) / double(interval)));
+    }
+
+    // whether blocks are timestamped, so their lifetime can be reported
+    extern std::atomic<bool> record_times;
+
+    // the number of phases finished so far
+    extern std::atomic<size_t> finished_phases;
+
+    // lifetime of a timestamped block that is being freed
+    void on_lifetime(uint64_t nanoseconds, size_t phases);
+
+    // whether the addresses of blocks are reported
+    extern std::atomic<bool> record_blocks;
+    void on_block_alloc(void* ptr, size_t size);
+    void on_block_free(void* ptr);
+
+    // the backend new blocks are allocated with, null for glibc
+    extern std::atomic<const tdc::MallocBackend*> backend;
+
+    // the backend other than glibc that has ever been selected, if any,
+    // which blocks flagged as not allocated by glibc belong to
+    extern std::atomic<const tdc::MallocBackend*> custom_backend;
+
+    // whether the allocation functions record their frame (for call sites)
+    extern std::atomic<bool> record_frames;
+
+    // the frame of the outermost allocation function of the calling thread,
+    // null if not within one or if frames are not recorded
+    extern thread_local void* allocation_frame
+        __attribute__((tls_model("initial-exec")));
 }
 /// \endcond
 
@@ -22,8 +87,10 @@ namespace malloc_callback {
 #ifndef __MACH__ // Temporary disable on OS X
 
 extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
 extern "C" void  __libc_free(void*);
 extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void* __libc_memalign(size_t, size_t);
 
 #endif
 #endif
@@ -0,0 +1,15 @@
+#include <tudocomp_stat/malloc.hpp>
+#include <tudocomp_stat/AllocLifetimes.hpp>
+
+using tdc::AllocLifetimes;
+
+AllocLifetimes::AllocLifetimes() {
+    for(size_t k = 0; k < num_buckets; k++) {
+        m_by_time[k] = 0;
+        m_by_phases[k] = 0;
+    }
+
+#if !defined(MALLOC_DISABLED) && !defined(STATS_DISABLED)
+    malloc_callback::record_times = true;
+#endif
+}
@@ -0,0 +1,288 @@
+#include <tudocomp_stat/malloc.hpp>
+#include <tudocomp_stat/CallSites.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include <pthread.h>
+
+using tdc::CallSites;
+
+std::atomic<size_t> CallSites::s_depth(8);
+std::atomic<size_t> CallSites::s_top(10);
+
+std::atomic<uint64_t> CallSites::s_next_id(1);
+
+__attribute__((tls_model("initial-exec")))
+thread_local CallSites::shard_cache_t CallSites::s_shard_cache = {0, nullptr};
+
+void CallSites::set_depth(size_t depth) {
+    s_depth = std::min(depth, size_t(max_depth));
+}
+
+void CallSites::set_top(size_t top) {
+    s_top = top;
+}
+
+size_t CallSites::depth() {
+    return s_depth.load();
+}
+
+size_t CallSites::hash_of(const uintptr_t* frames, size_t n) {
+    size_t h = 0;
+    for(size_t i = 0; i < n; i++) {
+        h ^= std::hash<uintptr_t>()(frames[i]) + 0x9E3779B97F4A7C15ULL +
+            (h << 6) + (h >> 2);
+    }
+    return h;
+}
+
+void CallSites::add(site_map_t& sites, size_t hash,
+    const uintptr_t* frames, size_t n, uint64_t count, uint64_t bytes) {
+
+    auto range = sites.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it) {
+        auto& site = it->second;
+        if(site.stack.size() == n &&
+           std::equal(frames, frames + n, site.stack.begin())) {
+
+            site.count += count;
+            site.bytes += bytes;
+            return;
+        }
+    }
+    sites.emplace(hash, site_t { stack_t(frames, frames + n), count, bytes });
+}
+
+void CallSites::add_all(site_map_t& sites, const site_map_t& other) {
+    for(auto& e : other) {
+        auto& site = e.second;
+        add(sites, e.first, site.stack.data(), site.stack.size(),
+            site.count, site.bytes);
+    }
+}
+
+namespace {
+    // bounds of the calling thread's stack, determined on first use
+    __attribute__((tls_model("initial-exec")))
+    thread_local uintptr_t t_stack_lo = 0;
+
+    __attribute__((tls_model("initial-exec")))
+    thread_local uintptr_t t_stack_hi = 0;
+
+    void determine_stack_bounds() {
+        pthread_attr_t attr;
+        void* addr;
+        size_t size;
+        if(pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if(pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                t_stack_lo = uintptr_t(addr);
+                t_stack_hi = uintptr_t(addr) + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+}
+
+size_t CallSites::capture(uintptr_t* frames, size_t depth) {
+    if(!t_stack_hi) determine_stack_bounds();
+
+#if !defined(MALLOC_DISABLED) && !defined(STATS_DISABLED)
+    void* start = malloc_callback::allocation_frame;
+#else
+    void* start = nullptr;
+#endif
+    if(!start) start = __builtin_frame_address(0);
+
+    // Each frame starts with the previous frame pointer, followed by the
+    // return address. Frames must be within the stack and grow upwards,
+    // anything else means that we left the chain of frame pointers.
+    auto fp = (const uintptr_t*)start;
+    size_t n = 0;
+    while(n < depth) {
+        const uintptr_t addr = uintptr_t(fp);
+        if(addr < t_stack_lo || addr + 2 * sizeof(uintptr_t) > t_stack_hi ||
+           addr % sizeof(uintptr_t) != 0) {
+            break;
+        }
+
+        const uintptr_t ret = fp[1];
+        if(!ret) break;
+        frames[n++] = ret;
+
+        auto next = (const uintptr_t*)fp[0];
+        if(next <= fp) break;
+        fp = next;
+    }
+    return n;
+}
+
+CallSites::CallSites() : m_id(s_next_id++) {
+#if !defined(MALLOC_DISABLED) && !defined(STATS_DISABLED)
+    malloc_callback::record_frames = true;
+#endif
+}
+
+// Only the first allocation of a thread in a phase, or after the thread
+// allocated in another phase, needs to look up its shard under the lock.
+CallSites::shard_t& CallSites::shard() {
+    if(s_shard_cache.id == m_id) return *s_shard_cache.shard;
+
+    const auto thread = std::this_thread::get_id();
+    shard_t* shard = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(auto& s : m_shards) {
+            if(s->thread == thread) shard = s.get();
+        }
+        if(!shard) {
+            m_shards.emplace_back(std::make_unique<shard_t>());
+            shard = m_shards.back().get();
+            shard->thread = thread;
+        }
+    }
+
+    s_shard_cache = shard_cache_t { m_id, shard };
+    return *shard;
+}
+
+void CallSites::on_alloc(size_t, size_t weight) {
+    uintptr_t frames[max_depth];
+    const size_t n = capture(frames, s_depth.load());
+    const size_t hash = hash_of(frames, n);
+
+    auto& s = shard();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    add(s.sites, hash, frames, n, 1, weight);
+}
+
+void CallSites::collect(site_map_t& sites) const {
+    add_all(sites, m_sites);
+    for(auto& s : m_shards) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        add_all(sites, s->sites);
+    }
+}
+
+void CallSites::propagate(const StatPhaseExtension& ext) {
+    auto& sub = *((const CallSites*)&ext);
+
+    std::lock(m_mutex, sub.m_mutex);
+    std::lock_guard<std::mutex> lock(m_mutex, std::adopt_lock);
+    std::lock_guard<std::mutex> sub_lock(sub.m_mutex, std::adopt_lock);
+    sub.collect(m_sites);
+}
+
+// a mapping from /proc/self/maps
+struct mapping_t {
+    uintptr_t start, end, offset;
+    std::string path;
+};
+
+static std::vector<mapping_t> read_executable_mappings() {
+    std::vector<mapping_t> mappings;
+
+    FILE* f = fopen("/proc/self/maps", "r");
+    if(!f) return mappings;
+
+    char line[4096];
+    while(fgets(line, sizeof(line), f)) {
+        unsigned long start, end, offset;
+        char perms[5];
+        int path_pos = 0;
+        if(sscanf(line, "%lx-%lx %4s %lx %*s %*s %n",
+            &start, &end, perms, &offset, &path_pos) < 4) continue;
+
+        if(perms[2] != 'x') continue;
+
+        std::string path(line + path_pos);
+        while(!path.empty() && (path.back() == '\n' || path.back() == ' ')) {
+            path.pop_back();
+        }
+        mappings.push_back(mapping_t { start, end, offset, path });
+    }
+    fclose(f);
+    return mappings;
+}
+
+static std::string to_hex(uintptr_t x) {
+    std::ostringstream ss;
+    ss << "0x" << std::hex << x;
+    return ss.str();
+}
+
+tdc::json CallSites::frames_of(const std::vector<uintptr_t>& stack) {
+    json frames = json::array();
+    for(auto addr : stack) frames.push_back(to_hex(addr));
+    return frames;
+}
+
+tdc::json CallSites::mappings_of(const std::vector<uintptr_t>& addresses) {
+    const auto mappings = read_executable_mappings();
+    std::map<size_t, size_t> used_mappings; // index -> position in output
+
+    for(auto addr : addresses) {
+        for(size_t m = 0; m < mappings.size(); m++) {
+            if(addr >= mappings[m].start && addr < mappings[m].end) {
+                used_mappings.emplace(m, used_mappings.size());
+                break;
+            }
+        }
+    }
+
+    json maps = json::array();
+    for(auto& e : used_mappings) {
+        auto& m = mappings[e.first];
+        maps.push_back(json({
+            {"start", to_hex(m.start)},
+            {"end", to_hex(m.end)},
+            {"offset", to_hex(m.offset)},
+            {"path", m.path}
+        }));
+    }
+    return maps;
+}
+
+void CallSites::write(json& data) {
+    site_map_t merged;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        collect(merged);
+    }
+
+    std::vector<const site_t*> sites;
+    for(auto& e : merged) sites.push_back(&e.second);
+
+    std::vector<uintptr_t> addresses;
+
+    auto top = [&](uint64_t site_t::* key){
+        const size_t k = std::min(s_top.load(), sites.size());
+        std::partial_sort(sites.begin(), sites.begin() + k, sites.end(),
+            [&](const site_t* a, const site_t* b){
+                return a->*key > b->*key;
+            });
+
+        json list = json::array();
+        for(size_t i = 0; i < k; i++) {
+            auto& stack = sites[i]->stack;
+            addresses.insert(addresses.end(), stack.begin(), stack.end());
+
+            list.push_back(json({
+                {"count", sites[i]->count},
+                {"bytes", sites[i]->bytes},
+                {"frames", frames_of(stack)}
+            }));
+        }
+        return list;
+    };
+
+    json result;
+    result["byBytes"] = top(&site_t::bytes);
+    result["byCount"] = top(&site_t::count);
+    result["maps"] = mappings_of(addresses);
+
+    data["callSites"] = result;
+}
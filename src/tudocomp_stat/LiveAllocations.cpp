@@ -0,0 +1,155 @@
+#include <tudocomp_stat/malloc.hpp>
+#include <tudocomp_stat/CallSites.hpp>
+#include <tudocomp_stat/LiveAllocations.hpp>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using tdc::CallSites;
+using tdc::LiveAllocations;
+
+std::atomic<bool> LiveAllocations::s_record_sites(true);
+std::atomic<size_t> LiveAllocations::s_top(10);
+std::atomic<uint64_t> LiveAllocations::s_next_id(0);
+
+void LiveAllocations::set_record_sites(bool record) {
+    s_record_sites = record;
+}
+
+void LiveAllocations::set_top(size_t top) {
+    s_top = top;
+}
+
+namespace {
+    using stack_t = std::vector<uintptr_t>;
+
+    struct block_t {
+        size_t size;
+        uint64_t phase;
+        uint32_t site;
+    };
+
+    // The table of live blocks shared by all phases. Call stacks are
+    // interned, so a block only refers to its call site by number.
+    struct table_t {
+        std::mutex mutex;
+        std::unordered_map<uintptr_t, block_t> blocks;
+        std::map<stack_t, uint32_t> site_ids;
+        std::vector<const stack_t*> sites;
+    };
+
+    // never destroyed, as blocks may be freed during static destruction
+    table_t& table() {
+        static auto t = new table_t();
+        return *t;
+    }
+}
+
+LiveAllocations::LiveAllocations() : m_id(s_next_id++), m_phases{m_id} {
+#if !defined(MALLOC_DISABLED) && !defined(STATS_DISABLED)
+    if(s_record_sites) malloc_callback::record_frames = true;
+    malloc_callback::record_blocks = true;
+#endif
+}
+
+LiveAllocations::~LiveAllocations() {
+    if(m_propagated) return;
+
+    auto& t = table();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    for(auto it = t.blocks.begin(); it != t.blocks.end();) {
+        if(m_phases.count(it->second.phase)) {
+            it = t.blocks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void LiveAllocations::on_block_alloc(const void* ptr, size_t bytes) {
+    stack_t stack;
+    if(s_record_sites.load(std::memory_order_relaxed)) {
+        uintptr_t frames[CallSites::max_depth];
+        const size_t n = CallSites::capture(frames, CallSites::depth());
+        stack.assign(frames, frames + n);
+    }
+
+    auto& t = table();
+    std::lock_guard<std::mutex> lock(t.mutex);
+
+    auto site = t.site_ids.emplace(std::move(stack), t.sites.size());
+    if(site.second) t.sites.push_back(&site.first->first);
+
+    // the address may still be listed if the block was freed untracked
+    t.blocks[uintptr_t(ptr)] = block_t { bytes, m_id, site.first->second };
+}
+
+void LiveAllocations::on_block_free(const void* ptr) {
+    auto& t = table();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    t.blocks.erase(uintptr_t(ptr));
+}
+
+void LiveAllocations::propagate(const StatPhaseExtension& ext) {
+    auto& sub = *((const LiveAllocations*)&ext);
+    m_phases.insert(sub.m_phases.begin(), sub.m_phases.end());
+    sub.m_propagated = true;
+}
+
+void LiveAllocations::write(json& data) {
+    struct site_stats_t {
+        uint32_t site;
+        uint64_t count;
+        uint64_t bytes;
+    };
+
+    auto& t = table();
+    std::lock_guard<std::mutex> lock(t.mutex);
+
+    // blocks allocated in this phase or its sub phases
+    std::unordered_map<uint32_t, site_stats_t> by_site;
+    uint64_t count = 0, bytes = 0;
+    for(auto& e : t.blocks) {
+        const block_t& block = e.second;
+        if(m_phases.count(block.phase)) {
+            auto& s = by_site.emplace(block.site,
+                site_stats_t { block.site, 0, 0 }).first->second;
+            s.count++;
+            s.bytes += block.size;
+            count++;
+            bytes += block.size;
+        }
+    }
+
+    std::vector<site_stats_t> sites;
+    for(auto& e : by_site) sites.push_back(e.second);
+
+    const size_t k = std::min(s_top.load(), sites.size());
+    std::partial_sort(sites.begin(), sites.begin() + k, sites.end(),
+        [](const site_stats_t& a, const site_stats_t& b){
+            return a.bytes > b.bytes;
+        });
+
+    json list = json::array();
+    std::vector<uintptr_t> addresses;
+    for(size_t i = 0; i < k; i++) {
+        auto& stack = *t.sites[sites[i].site];
+        addresses.insert(addresses.end(), stack.begin(), stack.end());
+
+        list.push_back(json({
+            {"count", sites[i].count},
+            {"bytes", sites[i].bytes},
+            {"frames", CallSites::frames_of(stack)}
+        }));
+    }
+
+    data["liveAllocations"] = json({
+        {"count", count},
+        {"bytes", bytes},
+        {"bySite", list},
+        {"maps", CallSites::mappings_of(addresses)}
+    });
+}
@@ -0,0 +1,214 @@
+#include <tudocomp_stat/malloc.hpp>
+#include <tudocomp_stat/MallocBackend.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include <pthread.h>
+
+using tdc::MallocBackend;
+
+#if !defined(MALLOC_DISABLED) && !defined(__CYGWIN__) && !defined(__MACH__)
+
+// the override replaces malloc, so glibc's functions are called directly
+static void* sys_malloc(size_t size) {
+    return __libc_malloc(size);
+}
+
+static void* sys_memalign(size_t alignment, size_t size) {
+    return __libc_memalign(alignment, size);
+}
+
+static void* sys_realloc(void* ptr, size_t size) {
+    return __libc_realloc(ptr, size);
+}
+
+static void sys_free(void* ptr) {
+    __libc_free(ptr);
+}
+
+#else
+
+static void* sys_malloc(size_t size) {
+    return std::malloc(size);
+}
+
+static void* sys_memalign(size_t alignment, size_t size) {
+    void* ptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+
+static void* sys_realloc(void* ptr, size_t size) {
+    return std::realloc(ptr, size);
+}
+
+static void sys_free(void* ptr) {
+    std::free(ptr);
+}
+
+#endif
+
+const MallocBackend tdc::libc_backend = {
+    "libc",
+    &sys_malloc,
+    &sys_memalign,
+    [](void* ptr, size_t, size_t new_size){
+        return sys_realloc(ptr, new_size);
+    },
+    [](void* ptr, size_t){
+        sys_free(ptr);
+    }
+};
+
+// Size class allocator.
+//
+// Class k holds blocks of 2^(k + MIN_CLASS_SHIFT) bytes. Chunks are aligned
+// to their size, so every block is aligned to its own size.
+namespace size_class {
+    constexpr size_t MIN_CLASS_SHIFT = 4;
+    constexpr size_t NUM_CLASSES = 12;
+    constexpr size_t MAX_SIZE =
+        size_t(1) << (MIN_CLASS_SHIFT + NUM_CLASSES - 1);
+    constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    static_assert(MAX_SIZE <= CHUNK_SIZE, "blocks must fit into a chunk");
+
+    struct free_block_t {
+        free_block_t* next;
+    };
+
+    inline size_t class_of(size_t size) {
+        return size <= (size_t(1) << MIN_CLASS_SHIFT)
+            ? 0 : 64 - __builtin_clzll(size - 1) - MIN_CLASS_SHIFT;
+    }
+
+    inline size_t size_of(size_t k) {
+        return size_t(1) << (k + MIN_CLASS_SHIFT);
+    }
+
+    // initial-exec avoids the TLS resolver, which may call malloc itself
+    __attribute__((tls_model("initial-exec")))
+    thread_local free_block_t* t_lists[NUM_CLASSES];
+
+    __attribute__((tls_model("initial-exec")))
+    thread_local bool t_registered = false;
+
+    // the free lists of exited threads
+    std::mutex s_orphans_mutex;
+    free_block_t* s_orphans[NUM_CLASSES];
+
+    void on_thread_exit(void*) {
+        std::lock_guard<std::mutex> lock(s_orphans_mutex);
+        for(size_t k = 0; k < NUM_CLASSES; k++) {
+            free_block_t* list = t_lists[k];
+            if(!list) continue;
+
+            free_block_t* last = list;
+            while(last->next) last = last->next;
+            last->next = s_orphans[k];
+            s_orphans[k] = list;
+            t_lists[k] = nullptr;
+        }
+        t_registered = false;
+    }
+
+    // get notified when the thread exits
+    void register_thread() {
+        static pthread_key_t exit_key = [](){
+            pthread_key_t key;
+            pthread_key_create(&key, &on_thread_exit);
+            return key;
+        }();
+        pthread_setspecific(exit_key, (void*)1);
+        t_registered = true;
+    }
+
+    free_block_t* refill(size_t k) {
+        {
+            std::lock_guard<std::mutex> lock(s_orphans_mutex);
+            free_block_t* list = s_orphans[k];
+            if(list) {
+                s_orphans[k] = nullptr;
+                return list;
+            }
+        }
+
+        char* chunk = (char*)sys_memalign(CHUNK_SIZE, CHUNK_SIZE);
+        if(!chunk) return nullptr;
+
+        const size_t size = size_of(k);
+        free_block_t* list = nullptr;
+        for(size_t i = CHUNK_SIZE; i >= size; i -= size) {
+            auto block = (free_block_t*)(chunk + i - size);
+            block->next = list;
+            list = block;
+        }
+        return list;
+    }
+
+    void* alloc_class(size_t k) {
+        if(!t_registered) register_thread();
+
+        free_block_t* block = t_lists[k];
+        if(!block) {
+            block = refill(k);
+            if(!block) return nullptr;
+        }
+        t_lists[k] = block->next;
+        return block;
+    }
+
+    void free_class(void* ptr, size_t k) {
+        if(!t_registered) register_thread();
+
+        auto block = (free_block_t*)ptr;
+        block->next = t_lists[k];
+        t_lists[k] = block;
+    }
+
+    void* malloc(size_t size) {
+        return size <= MAX_SIZE ? alloc_class(class_of(size))
+                                : sys_malloc(size);
+    }
+
+    // the class size is a power of two larger than the alignment
+    void* memalign(size_t alignment, size_t size) {
+        return size <= MAX_SIZE ? alloc_class(class_of(size))
+                                : sys_memalign(alignment, size);
+    }
+
+    void free(void* ptr, size_t size) {
+        if(size <= MAX_SIZE) {
+            free_class(ptr, class_of(size));
+        } else {
+            sys_free(ptr);
+        }
+    }
+
+    void* realloc(void* ptr, size_t old_size, size_t new_size) {
+        if(old_size > MAX_SIZE && new_size > MAX_SIZE) {
+            return sys_realloc(ptr, new_size);
+        } else if(old_size <= MAX_SIZE && new_size <= MAX_SIZE &&
+                  class_of(old_size) == class_of(new_size)) {
+            return ptr;
+        }
+
+        void* new_ptr = malloc(new_size);
+        if(!new_ptr) return new_ptr;
+
+        memcpy(new_ptr, ptr, std::min(old_size, new_size));
+        free(ptr, old_size);
+        return new_ptr;
+    }
+}
+
+const MallocBackend tdc::size_class_backend = {
+    "size_class",
+    &size_class::malloc,
+    &size_class::memalign,
+    &size_class::realloc,
+    &size_class::free
+};
@@ -0,0 +1,153 @@
+#include <tudocomp_stat/MemTimeline.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <time.h>
+
+using tdc::MemTimeline;
+
+std::atomic<size_t> MemTimeline::s_min_bytes(64 * 1024);
+std::atomic<uint64_t> MemTimeline::s_min_nanos(1000000);
+std::atomic<size_t> MemTimeline::s_max_points(1000);
+
+void MemTimeline::set_min_delta(size_t bytes, double milliseconds) {
+    s_min_bytes = bytes;
+    s_min_nanos = uint64_t(milliseconds * 1e6);
+}
+
+void MemTimeline::set_max_points(size_t points) {
+    s_max_points = std::max(points, size_t(2));
+}
+
+static uint64_t now_nanos() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return uint64_t(t.tv_sec) * 1000000000ULL + uint64_t(t.tv_nsec);
+}
+
+MemTimeline::MemTimeline()
+    : m_start(now_nanos()),
+      m_min_bytes(s_min_bytes),
+      m_min_nanos(s_min_nanos) {
+}
+
+// Called with the lock held.
+void MemTimeline::update(ssize_t delta) {
+    m_current += delta;
+    m_peak = std::max(m_peak, m_current);
+
+    const uint64_t now = now_nanos();
+    const point_t last = m_points.empty()
+        ? point_t { m_start, 0, 0 } : m_points.back();
+
+    const size_t change = size_t(std::abs(m_current - last.bytes));
+    if(change >= m_min_bytes ||
+       (change && now - last.time >= m_min_nanos)) {
+
+        m_points.push_back(point_t { now, m_current, m_peak });
+        m_peak = m_current;
+        if(m_points.size() > s_max_points) downsample();
+    }
+}
+
+// Keeps every other point, which covers the peak of the dropped one.
+void MemTimeline::downsample() {
+    size_t n = 0;
+    for(size_t i = 1; i < m_points.size(); i += 2) {
+        point_t p = m_points[i];
+        p.peak = std::max(p.peak, m_points[i - 1].peak);
+        m_points[n++] = p;
+    }
+    if(m_points.size() % 2) {
+        // the last point is not paired, but kept
+        m_points[n++] = m_points.back();
+    }
+    m_points.resize(n);
+
+    m_min_bytes *= 2;
+    m_min_nanos *= 2;
+}
+
+void MemTimeline::on_alloc(size_t, size_t weight) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    update(ssize_t(weight));
+}
+
+void MemTimeline::on_free(size_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    update(-ssize_t(bytes));
+}
+
+void MemTimeline::finish() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_end = now_nanos();
+}
+
+// Changes of this phase that were not recorded as a point yet are taken
+// to have happened before the points of the sub phase that follow the last
+// point of this phase. Phases of the same thread do not overlap, so this
+// phase received no events while the sub phase was running.
+void MemTimeline::propagate(const StatPhaseExtension& ext) {
+    auto& sub = *((const MemTimeline*)&ext);
+
+    std::lock(m_mutex, sub.m_mutex);
+    std::lock_guard<std::mutex> lock(m_mutex, std::adopt_lock);
+    std::lock_guard<std::mutex> sub_lock(sub.m_mutex, std::adopt_lock);
+
+    std::vector<point_t> sub_points(sub.m_points);
+    sub_points.push_back(point_t { sub.m_end, sub.m_current, sub.m_peak });
+
+    std::vector<point_t> points;
+    points.reserve(m_points.size() + sub_points.size());
+
+    // the bytes of either timeline at the current point
+    ssize_t own = 0, other = 0;
+    bool own_last = false;
+    size_t i = 0, k = 0;
+    while(i < m_points.size() || k < sub_points.size()) {
+        own_last = k == sub_points.size() ||
+            (i < m_points.size() && m_points[i].time <= sub_points[k].time);
+
+        if(own_last) {
+            const point_t& p = m_points[i++];
+            own = p.bytes;
+            points.push_back(
+                point_t { p.time, p.bytes + other, p.peak + other });
+        } else {
+            const point_t& p = sub_points[k++];
+            if(i == m_points.size()) own = m_current;
+            other = p.bytes;
+            points.push_back(point_t { p.time, own + p.bytes, own + p.peak });
+        }
+    }
+
+    m_points.swap(points);
+    m_current += sub.m_current;
+
+    // the peak since the last point holds for this phase, unless the last
+    // point is the end of the sub phase
+    m_peak = own_last ? m_peak + sub.m_current : m_current;
+    while(m_points.size() > s_max_points) downsample();
+}
+
+void MemTimeline::write(json& data) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto to_json = [&](const point_t& p){
+        return json({
+            {"time", double(p.time - m_start) / 1e6},
+            {"bytes", p.bytes},
+            {"peak", p.peak}
+        });
+    };
+
+    json points = json::array();
+    for(auto& p : m_points) points.push_back(to_json(p));
+
+    // the current state, unless nothing happened since the last point
+    const ssize_t last = m_points.empty() ? 0 : m_points.back().bytes;
+    if(m_current != last || m_peak != last) {
+        points.push_back(to_json(point_t { now_nanos(), m_current, m_peak }));
+    }
+    data["memTimeline"] = points;
+}
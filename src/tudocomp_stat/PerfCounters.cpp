@@ -0,0 +1,219 @@
+#include <tudocomp_stat/PerfCounters.hpp>
+
+#include <cerrno>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using tdc::PerfCounters;
+
+std::atomic<uint32_t> PerfCounters::s_events(PerfCounters::ALL_EVENTS);
+thread_local PerfCounters* PerfCounters::s_active = nullptr;
+
+void PerfCounters::set_events(uint32_t events) {
+    s_events = events & ALL_EVENTS;
+}
+
+namespace {
+    struct event_info_t {
+        const char* name;
+        uint32_t type;
+        uint64_t config;
+    };
+
+    // in the order of the event flags
+    constexpr event_info_t event_info[PerfCounters::num_events] = {
+        { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { "cacheReferences", PERF_TYPE_HARDWARE,
+            PERF_COUNT_HW_CACHE_REFERENCES },
+        { "cacheMisses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { "branches", PERF_TYPE_HARDWARE,
+            PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+        { "branchMisses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { "dtlbLoadMisses", PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_DTLB |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    };
+
+    int perf_event_open(perf_event_attr& attr, int group_fd) {
+        return int(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+    }
+
+    // the layout of a group read with PERF_FORMAT_GROUP
+    struct group_read_t {
+        uint64_t nr;
+        uint64_t time_enabled;
+        uint64_t time_running;
+        uint64_t values[PerfCounters::num_events];
+    };
+
+    // adds the counts of a group to the given counts per event
+    void read_group(int leader, size_t num, const size_t* events,
+                    uint64_t* counts) {
+
+        group_read_t group;
+        const ssize_t n = read(leader, &group, sizeof(group));
+        if(n < ssize_t(3 * sizeof(uint64_t)) || group.nr != num) return;
+
+        // scale the counts up if the counters were multiplexed
+        const double scale =
+            (group.time_running && group.time_running < group.time_enabled)
+            ? double(group.time_enabled) / double(group.time_running)
+            : 1.0;
+
+        for(size_t i = 0; i < num; i++) {
+            counts[events[i]] += uint64_t(double(group.values[i]) * scale);
+        }
+    }
+}
+
+PerfCounters::PerfCounters() {
+    for(size_t e = 0; e < num_events; e++) {
+        m_sub[e] = 0;
+        m_final[e] = 0;
+    }
+
+    // open the group disabled, so the counters are started together
+    const uint32_t events = s_events;
+    for(size_t e = 0; e < num_events; e++) {
+        if(!(events & (1U << e))) continue;
+
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = event_info[e].type;
+        attr.config = event_info[e].config;
+        attr.disabled = (m_num_fds == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        const int fd = perf_event_open(attr, m_num_fds ? m_fds[0] : -1);
+        if(fd < 0) {
+            // unsupported events are omitted
+            if(!m_error) m_error = errno;
+            continue;
+        }
+
+        m_fds[m_num_fds] = fd;
+        m_events[m_num_fds] = e;
+        ++m_num_fds;
+        m_counted |= 1U << e;
+    }
+
+    // take over counting from the enclosing phase of this thread
+    m_outer = s_active;
+    if(m_outer) m_outer->disable();
+    s_active = this;
+
+    enable();
+}
+
+PerfCounters::~PerfCounters() {
+    close();
+    if(s_active == this) s_active = m_outer;
+}
+
+void PerfCounters::enable() const {
+    if(m_num_fds) {
+        ioctl(m_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void PerfCounters::disable() const {
+    if(m_num_fds) {
+        ioctl(m_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void PerfCounters::close() {
+    if(m_closed) return;
+
+    if(m_num_fds) {
+        disable();
+
+        read_group(m_fds[0], m_num_fds, m_events, m_final);
+
+        // close the members before the leader
+        for(size_t i = m_num_fds; i > 0; i--) {
+            ::close(m_fds[i - 1]);
+        }
+        m_num_fds = 0;
+    }
+    m_closed = true;
+}
+
+void PerfCounters::read(uint64_t counts[num_events]) const {
+    for(size_t e = 0; e < num_events; e++) {
+        counts[e] = m_sub[e] + m_final[e];
+    }
+
+    if(!m_closed && m_num_fds) {
+        read_group(m_fds[0], m_num_fds, m_events, counts);
+    }
+}
+
+void PerfCounters::pause() {
+    disable();
+}
+
+void PerfCounters::resume() {
+    enable();
+}
+
+// The counters belong to the thread running the phase, which may not be
+// the one propagating it.
+void PerfCounters::finish() {
+    close();
+
+    // hand counting back to the enclosing phase
+    if(s_active == this) {
+        s_active = m_outer;
+        if(s_active) s_active->enable();
+    }
+}
+
+void PerfCounters::propagate(const StatPhaseExtension& ext) {
+    auto& sub = *((const PerfCounters*)&ext);
+
+    // the sub phase has finished, so its counters are closed
+    for(size_t e = 0; e < num_events; e++) {
+        m_sub[e] += sub.m_sub[e] + sub.m_final[e];
+    }
+    m_counted |= sub.m_counted;
+}
+
+void PerfCounters::write(json& data) {
+    json perf = json::object();
+    if(!m_counted) {
+        perf["error"] = std::strerror(m_error ? m_error : EINVAL);
+        data["perfCounters"] = perf;
+        return;
+    }
+
+    uint64_t counts[num_events];
+    read(counts);
+
+    for(size_t e = 0; e < num_events; e++) {
+        if(m_counted & (1U << e)) perf[event_info[e].name] = counts[e];
+    }
+
+    auto ratio = [&](event_t num, event_t den, const char* key){
+        const size_t n = __builtin_ctz(num);
+        const size_t d = __builtin_ctz(den);
+        if((m_counted & num) && (m_counted & den) && counts[d]) {
+            perf[key] = double(counts[n]) / double(counts[d]);
+        }
+    };
+    ratio(INSTRUCTIONS, CYCLES, "ipc");
+    ratio(CACHE_MISSES, CACHE_REFERENCES, "cacheMissRate");
+    ratio(BRANCH_MISSES, BRANCHES, "branchMissRate");
+
+    data["perfCounters"] = perf;
+}
@@ -0,0 +1,115 @@
+#include <tudocomp_stat/ProcessIO.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+using tdc::ProcessIO;
+
+static uint64_t now_nanos() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return uint64_t(t.tv_sec) * 1000000000ULL + uint64_t(t.tv_nsec);
+}
+
+// Reading the counters is a read system call itself, which the kernel
+// accounts once it has completed, i.e., in all later readings. These reads
+// are counted here and subtracted.
+static std::atomic<uint64_t> s_own_calls(0);
+static std::atomic<uint64_t> s_own_chars(0);
+
+bool ProcessIO::read_counters(counters_t& counters) {
+    const int fd = open("/proc/self/io", O_RDONLY);
+    if(fd < 0) return false;
+
+    const uint64_t own_calls = s_own_calls.load();
+    const uint64_t own_chars = s_own_chars.load();
+
+    char buf[512];
+    const ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n >= 0) {
+        s_own_calls += 1;
+        s_own_chars += uint64_t(n);
+    }
+    if(n <= 0) return false;
+    buf[n] = 0;
+
+    // parse lines of the form "key: value"
+    struct { const char* key; uint64_t* value; } fields[] = {
+        { "rchar", &counters.rchar },
+        { "wchar", &counters.wchar },
+        { "syscr", &counters.syscr },
+        { "syscw", &counters.syscw },
+        { "read_bytes", &counters.read_bytes },
+        { "write_bytes", &counters.write_bytes },
+    };
+
+    size_t found = 0;
+    for(char* line = buf; line && *line; ) {
+        char* next = std::strchr(line, '\n');
+        if(next) *next++ = 0;
+
+        char* colon = std::strchr(line, ':');
+        if(colon) {
+            *colon = 0;
+            for(auto& f : fields) {
+                if(std::strcmp(line, f.key) == 0) {
+                    *f.value = std::strtoull(colon + 1, nullptr, 10);
+                    ++found;
+                }
+            }
+        }
+        line = next;
+    }
+    counters.syscr -= own_calls;
+    counters.rchar -= own_chars;
+    return found == sizeof(fields) / sizeof(fields[0]);
+}
+
+ProcessIO::ProcessIO() {
+    m_valid = read_counters(m_start);
+    m_start_time = now_nanos();
+}
+
+void ProcessIO::pause() {
+    m_pause_time = now_nanos();
+}
+
+void ProcessIO::resume() {
+    m_paused += now_nanos() - m_pause_time;
+}
+
+void ProcessIO::propagate(const StatPhaseExtension& ext) {
+    // the counters run through sub phases, but their pauses must be added
+    // like the phases' own pause times
+    auto& sub = *((const ProcessIO*)&ext);
+    m_paused += sub.m_paused;
+}
+
+void ProcessIO::write(json& data) {
+    counters_t end;
+    if(!m_valid || !read_counters(end)) return;
+
+    const double run = double(now_nanos() - m_start_time - m_paused) / 1e9;
+    auto rate = [&](uint64_t bytes){
+        return run > 0 ? double(bytes) / 1e6 / run : 0.0;
+    };
+
+    const uint64_t rchar = end.rchar - m_start.rchar;
+    const uint64_t wchar = end.wchar - m_start.wchar;
+    data["processIO"] = json({
+        {"readChars", rchar},
+        {"writeChars", wchar},
+        {"readCalls", end.syscr - m_start.syscr},
+        {"writeCalls", end.syscw - m_start.syscw},
+        {"readBytes", end.read_bytes - m_start.read_bytes},
+        {"writeBytes", end.write_bytes - m_start.write_bytes},
+        {"readRate", rate(rchar)},
+        {"writeRate", rate(wchar)},
+    });
+}
@@ -3,17 +3,528 @@
 
 #ifndef STATS_DISABLED
 
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+#include <unistd.h>
+
+using tdc::MallocBackend;
 using tdc::StatPhase;
 
 std::vector<std::function<StatPhase::ext_ptr_t()>>
     StatPhase::m_extension_registry;
+std::vector<size_t> StatPhase::m_alloc_listener_registry;
+
+std::atomic<StatPhase*> StatPhase::s_current(nullptr);
+
+__attribute__((tls_model("initial-exec")))
+thread_local StatPhase* StatPhase::s_thread_current = nullptr;
+
+thread_local StatPhase* StatPhase::s_thread_attach = nullptr;
+thread_local size_t StatPhase::s_thread_index = 0;
+
+size_t StatPhase::s_arena_chunk_size = 1024 * 1024;
+bool StatPhase::s_arena_huge_pages = false;
+
+void StatPhase::set_arena_options(size_t chunk_size, bool huge_pages) {
+    if(in_measurement()) {
+        throw std::runtime_error(
+            "The arena options must be set outside of any "
+            "stat measurements!");
+    }
 
-StatPhase* StatPhase::s_current = nullptr;
-uint16_t StatPhase::s_suppress_memory_tracking_state = 0;
-uint16_t StatPhase::s_suppress_tracking_user_state = 0;
+    s_arena_chunk_size = chunk_size;
+    s_arena_huge_pages = huge_pages;
+}
+
+tdc::TscClock StatPhase::s_tsc;
+bool StatPhase::s_use_tsc = false;
+
+bool StatPhase::set_time_source(time_source_t source) {
+    if(in_measurement()) {
+        throw std::runtime_error(
+            "The time source must be set outside of any "
+            "stat measurements!");
+    }
+
+    s_use_tsc = false;
+    if(source == TIME_TSC) {
+        s_use_tsc = s_tsc.calibrated() || s_tsc.calibrate();
+    }
+    return time_source() == source;
+}
+
+__attribute__((tls_model("initial-exec")))
+thread_local uint16_t StatPhase::s_suppress_memory_tracking_state = 0;
+
+std::atomic<uint16_t> StatPhase::s_suppress_tracking_user_state(0);
+
+__attribute__((tls_model("initial-exec")))
+thread_local uint16_t StatPhase::s_suppress_tracking_thread_state = 0;
 
 bool StatPhase::s_init = false;
 
+namespace {
+
+// Per-thread accounting buffer.
+//
+// Threads that do not own the current phase account their allocations here
+// instead of touching the phase directly. Only the thread using the buffer
+// writes "produced", so no read-modify-write is needed for that. Publishing
+// claims the difference to "consumed" using a CAS, which allows the phase
+// owner to drain the buffers of all threads at phase boundaries without
+// any locking.
+//
+// Buffers are linked into a global list and never freed. When a thread
+// exits, its buffer is published and can be reused by another thread.
+//
+// Calls of allocation functions are buffered the same way, but only
+// published along with the bytes.
+struct buffered_t {
+    std::atomic<ssize_t> produced {0};
+    std::atomic<ssize_t> consumed {0};
+
+    inline void add(ssize_t delta) {
+        produced.store(produced.load(std::memory_order_relaxed) + delta,
+            std::memory_order_relaxed);
+    }
+
+    inline ssize_t pending() const {
+        return produced.load(std::memory_order_relaxed) -
+            consumed.load(std::memory_order_relaxed);
+    }
+
+    // claims the unpublished amount
+    inline ssize_t claim() {
+        ssize_t c = consumed.load();
+        ssize_t p = produced.load();
+        while(p != c) {
+            if(consumed.compare_exchange_weak(c, p)) return p - c;
+            p = produced.load();
+        }
+        return 0;
+    }
+};
+
+struct thread_buffer {
+    buffered_t bytes;
+    buffered_t calls[StatPhase::NUM_ALLOC_CALLS];
+    std::atomic<bool> in_use {true};
+    thread_buffer* next = nullptr;
+
+    size_t owned_phases = 0;
+
+    inline void claim_calls(size_t* out) {
+        for(size_t i = 0; i < StatPhase::NUM_ALLOC_CALLS; i++) {
+            out[i] = calls[i].claim();
+        }
+    }
+};
+
+std::atomic<thread_buffer*> s_thread_buffers(nullptr);
+std::atomic<size_t> s_thread_buffer_size(64 * 1024);
+
+// number of threads currently publishing to a phase
+std::atomic<size_t> s_publishers(0);
+
+// initial-exec avoids the TLS resolver, which may call malloc itself
+__attribute__((tls_model("initial-exec")))
+thread_local thread_buffer* t_buffer = nullptr;
+
+// Registry of tracked memory mappings, mapping start to end addresses.
+//
+// Mappings may be unmapped or remapped partially, so the tracked ranges are
+// split as needed. The registry is created on first use, since mappings may
+// be created before static initialization is complete.
+using mapping_registry_t = std::map<uintptr_t, uintptr_t>;
+
+std::mutex s_mappings_mutex;
+
+inline mapping_registry_t& mappings() {
+    static auto registry = new mapping_registry_t();
+    return *registry;
+}
+
+inline uintptr_t round_to_pages(uintptr_t x) {
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    return (x + page_size - 1) / page_size * page_size;
+}
+
+// Removes the range [begin, end) from the registry, returns the amount of
+// bytes that were removed.
+size_t remove_mappings(mapping_registry_t& registry,
+    uintptr_t begin, uintptr_t end) {
+
+    size_t removed = 0;
+
+    auto it = registry.upper_bound(begin);
+    if(it != registry.begin()) --it;
+
+    while(it != registry.end() && it->first < end) {
+        const uintptr_t first = it->first;
+        const uintptr_t last = it->second;
+        if(last <= begin) {
+            ++it;
+            continue;
+        }
+
+        removed += std::min(last, end) - std::max(first, begin);
+        it = registry.erase(it);
+
+        // keep the parts outside of the range
+        if(first < begin) registry.emplace(first, begin);
+        if(last > end) registry.emplace(end, last);
+    }
+    return removed;
+}
+
+}
+
+// Assigns a buffer to the calling thread.
+//
+// Must be called with memory tracking suppressed.
+static thread_buffer* acquire_thread_buffer(void (*on_exit)(void*)) {
+    thread_buffer* buf = nullptr;
+
+    // try to reuse the buffer of an exited thread
+    for(auto b = s_thread_buffers.load(); b; b = b->next) {
+        bool expected = false;
+        if(b->in_use.compare_exchange_strong(expected, true)) {
+            buf = b;
+            break;
+        }
+    }
+
+    if(!buf) {
+        buf = new thread_buffer();
+        buf->next = s_thread_buffers.load();
+        while(!s_thread_buffers.compare_exchange_weak(buf->next, buf)) {
+        }
+    }
+
+    // get notified when the thread exits
+    static pthread_key_t exit_key = [&](){
+        pthread_key_t key;
+        pthread_key_create(&key, on_exit);
+        return key;
+    }();
+    pthread_setspecific(exit_key, buf);
+
+    t_buffer = buf;
+    return buf;
+}
+
+// Unless the calling thread owns the current phase, it announces itself as
+// a publisher so that the phase cannot end during the notification.
+template<typename F>
+void StatPhase::notify(F func) {
+    suppress_memory_tracking guard;
+
+    StatPhase* local = s_thread_current;
+    if(local) {
+        // the calling thread runs phases of its own
+        for(auto ext : *local->m_alloc_listeners) func(ext);
+        return;
+    }
+
+    const bool owner = t_buffer && t_buffer->owned_phases;
+
+    if(!owner) s_publishers++;
+    StatPhase* current = s_current.load();
+    if(current) {
+        for(auto ext : *current->m_alloc_listeners) func(ext);
+    }
+    if(!owner) s_publishers--;
+}
+
+bool StatPhase::track_alloc(size_t bytes) {
+    return track_alloc(bytes, bytes);
+}
+
+bool StatPhase::track_alloc(size_t bytes, size_t weight) {
+    if(currently_tracking_memory()) {
+        if(!track_delta(ssize_t(weight))) return false;
+        if(!m_alloc_listener_registry.empty()) {
+            notify([&](StatPhaseExtension* ext){
+                ext->on_alloc(bytes, weight);
+            });
+        }
+    }
+    return true;
+}
+
+void StatPhase::track_free(size_t bytes) {
+    if(currently_tracking_memory()) {
+        track_delta(-ssize_t(bytes));
+        if(!m_alloc_listener_registry.empty()) {
+            notify([&](StatPhaseExtension* ext){ ext->on_free(bytes); });
+        }
+    }
+}
+
+void StatPhase::track_map(const void* addr, size_t length) {
+    const uintptr_t begin = uintptr_t(addr);
+    const uintptr_t end = begin + round_to_pages(length);
+
+    size_t removed;
+    {
+        suppress_memory_tracking guard;
+        std::lock_guard<std::mutex> lock(s_mappings_mutex);
+
+        // a fixed mapping replaces whatever was mapped before
+        auto& registry = mappings();
+        removed = remove_mappings(registry, begin, end);
+        registry.emplace(begin, end);
+    }
+
+    if(removed) track_mapped(-ssize_t(removed));
+    track_mapped(ssize_t(end - begin));
+}
+
+size_t StatPhase::track_unmap(const void* addr, size_t length) {
+    const uintptr_t begin = uintptr_t(addr);
+    const uintptr_t end = begin + round_to_pages(length);
+
+    size_t removed;
+    {
+        suppress_memory_tracking guard;
+        std::lock_guard<std::mutex> lock(s_mappings_mutex);
+        removed = remove_mappings(mappings(), begin, end);
+    }
+
+    if(removed) track_mapped(-ssize_t(removed));
+    return removed;
+}
+
+// Mapped bytes are tracked like allocations. In addition, they are counted
+// directly for the current phase, using the same protection against the
+// phase ending as notify.
+void StatPhase::track_mapped(ssize_t delta) {
+    if(!currently_tracking_memory()) return;
+
+    if(delta > 0) {
+        track_alloc(delta);
+    } else {
+        track_free(-delta);
+    }
+
+    StatPhase* local = s_thread_current;
+    if(local) {
+        local->m_mem.mapped.fetch_add(delta);
+        return;
+    }
+
+    const bool owner = t_buffer && t_buffer->owned_phases;
+    if(!owner) s_publishers++;
+    StatPhase* current = s_current.load();
+    if(current) current->m_mem.mapped.fetch_add(delta);
+    if(!owner) s_publishers--;
+}
+
+bool StatPhase::track_delta(ssize_t delta) {
+    StatPhase* local = s_thread_current;
+    if(local) {
+        // the calling thread runs phases of its own
+        return local->track_internal(delta, true);
+    }
+
+    thread_buffer* buf = t_buffer;
+    if(buf && buf->owned_phases) {
+        // the current phase belongs to this thread
+        return s_current.load(std::memory_order_relaxed)->track_internal(
+            delta, true);
+    }
+
+    if(!s_current.load(std::memory_order_relaxed)) return true;
+
+    if(!buf) {
+        suppress_memory_tracking guard;
+        buf = acquire_thread_buffer(&StatPhase::on_thread_exit);
+    }
+
+    buf->bytes.add(delta);
+
+    const ssize_t pending = buf->bytes.pending();
+    const ssize_t size = s_thread_buffer_size.load(std::memory_order_relaxed);
+    if(pending >= size || -pending >= size) {
+        size_t calls[NUM_ALLOC_CALLS];
+
+        // the current phase cannot end before s_publishers drops to zero
+        s_publishers++;
+        StatPhase* current = s_current.load();
+        const ssize_t bytes = buf->bytes.claim();
+        buf->claim_calls(calls);
+        if(current) {
+            current->track_internal(bytes);
+            current->track_calls_internal(calls);
+        }
+        s_publishers--;
+    }
+    return true;
+}
+
+void StatPhase::set_budget(size_t bytes, budget_action_t action,
+    std::function<void(StatPhase&)> callback) {
+
+    if(action == BUDGET_CALLBACK && !callback) {
+        throw std::runtime_error(
+            "A memory budget with a callback requires a callback!");
+    }
+    if(m_running_subs.load() != 0) {
+        throw std::runtime_error(
+            "The memory budget must be set while no sub phases are running!");
+    }
+
+    {
+        suppress_memory_tracking guard;
+        count_refusing_budget(m_own_budget.get(), -1);
+        m_own_budget = std::make_unique<budget_t>(
+            budget_t { bytes, action, std::move(callback) });
+        count_refusing_budget(m_own_budget.get(), 1);
+    }
+    update_budget();
+}
+
+void StatPhase::count_refusing_budget(const budget_t* budget, int delta) {
+#ifndef MALLOC_DISABLED
+    if(budget && budget->action == BUDGET_FAIL) {
+        malloc_callback::refusing_budgets += delta;
+    }
+#endif
+}
+
+bool StatPhase::exceed_budget() {
+    const budget_t* budget = m_budget;
+    if(!budget) return true;
+
+    if(m_budget_exceeded.fetch_add(1, std::memory_order_relaxed) == 0) {
+        if(budget->action == BUDGET_LOG) {
+            fprintf(stderr,
+                "tudocomp_stat: phase \"%s\" exceeded its memory budget "
+                "of %zu bytes\n", m_title.c_str(), budget->bytes);
+        } else if(budget->action == BUDGET_CALLBACK) {
+            budget->callback(*this);
+        }
+    }
+    return budget->action != BUDGET_FAIL;
+}
+
+void StatPhase::track_call(alloc_call_t call) {
+    if(!currently_tracking_memory()) return;
+
+    StatPhase* local = s_thread_current;
+    if(local) {
+        local->m_calls[call].fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    thread_buffer* buf = t_buffer;
+    if(buf && buf->owned_phases) {
+        // the current phase belongs to this thread
+        s_current.load(std::memory_order_relaxed)->m_calls[call].fetch_add(
+            1, std::memory_order_relaxed);
+        return;
+    }
+
+    if(!s_current.load(std::memory_order_relaxed)) return;
+
+    if(!buf) {
+        suppress_memory_tracking guard;
+        buf = acquire_thread_buffer(&StatPhase::on_thread_exit);
+    }
+    buf->calls[call].add(1);
+}
+
+void StatPhase::track_lifetime(uint64_t nanoseconds, size_t phases) {
+    if(currently_tracking_memory() && !m_alloc_listener_registry.empty()) {
+        notify([&](StatPhaseExtension* ext){
+            ext->on_lifetime(nanoseconds, phases);
+        });
+    }
+}
+
+void StatPhase::track_block_alloc(const void* ptr, size_t bytes) {
+    if(currently_tracking_memory() && !m_alloc_listener_registry.empty()) {
+        notify([&](StatPhaseExtension* ext){
+            ext->on_block_alloc(ptr, bytes);
+        });
+    }
+}
+
+// Blocks allocated while tracking was not suppressed by the user may be
+// freed while it is, so only internal suppression applies here.
+void StatPhase::track_block_free(const void* ptr) {
+    if(!suppress_memory_tracking::is_paused() &&
+       !m_alloc_listener_registry.empty()) {
+
+        notify([&](StatPhaseExtension* ext){
+            ext->on_block_free(ptr);
+        });
+    }
+}
+
+void StatPhase::drain_thread_buffers() {
+    thread_buffer* own = t_buffer;
+    if(!own || !own->owned_phases) return;
+
+    StatPhase* current = s_current.load();
+    for(auto b = s_thread_buffers.load(); b; b = b->next) {
+        size_t calls[NUM_ALLOC_CALLS];
+        const ssize_t delta = b->bytes.claim();
+        b->claim_calls(calls);
+        if(current) {
+            current->track_internal(delta);
+            current->track_calls_internal(calls);
+        }
+    }
+}
+
+void StatPhase::await_publishers() {
+    while(s_publishers.load()) {
+        std::this_thread::yield();
+    }
+}
+
+bool StatPhase::owns_current_phase() {
+    return t_buffer && t_buffer->owned_phases;
+}
+
+void StatPhase::enter_owner() {
+    thread_buffer* buf = t_buffer;
+    if(!buf) buf = acquire_thread_buffer(&StatPhase::on_thread_exit);
+    buf->owned_phases++;
+}
+
+void StatPhase::leave_owner() {
+    t_buffer->owned_phases--;
+}
+
+void StatPhase::on_thread_exit(void* p) {
+    auto buf = (thread_buffer*)p;
+
+    size_t calls[NUM_ALLOC_CALLS];
+
+    s_publishers++;
+    StatPhase* current = s_current.load();
+    const ssize_t delta = buf->bytes.claim();
+    buf->claim_calls(calls);
+    if(current) {
+        current->track_internal(delta);
+        current->track_calls_internal(calls);
+    }
+    s_publishers--;
+
+    t_buffer = nullptr;
+    buf->owned_phases = 0;
+    buf->in_use = false;
+}
+
+void StatPhase::set_thread_buffer_size(size_t bytes) {
+    s_thread_buffer_size = bytes;
+}
+
 #ifndef MALLOC_DISABLED
 
 void StatPhase::force_malloc_override_link() {
@@ -34,19 +545,150 @@ void StatPhase::force_malloc_override_link() {
     free(p);
 }
 
-void malloc_callback::on_alloc(size_t bytes) {
-    StatPhase::track_alloc(bytes);
+std::atomic<size_t> malloc_callback::sample_interval(0);
+std::atomic<bool> malloc_callback::sampling_used(false);
+std::atomic<bool> malloc_callback::record_frames(false);
+std::atomic<bool> malloc_callback::record_times(false);
+std::atomic<bool> malloc_callback::record_blocks(false);
+std::atomic<size_t> malloc_callback::finished_phases(0);
+std::atomic<size_t> malloc_callback::refusing_budgets(0);
+std::atomic<const MallocBackend*> malloc_callback::backend(nullptr);
+std::atomic<const MallocBackend*> malloc_callback::custom_backend(nullptr);
+thread_local void* malloc_callback::allocation_frame = nullptr;
+
+void StatPhase::count_finished_phase() {
+    malloc_callback::finished_phases.fetch_add(1, std::memory_order_relaxed);
+}
+
+void StatPhase::set_sample_interval(size_t bytes) {
+    if(in_measurement()) {
+        throw std::runtime_error(
+            "The sample interval must be set outside of any "
+            "stat measurements!");
+    }
+
+#ifdef MALLOC_HEADERLESS
+    if(bytes) {
+        throw std::runtime_error(
+            "Allocation sampling is not supported in headerless mode!");
+    }
+#endif
+
+    if(bytes) malloc_callback::sampling_used = true;
+    malloc_callback::sample_interval = bytes;
+}
+
+size_t StatPhase::sample_interval() {
+    return malloc_callback::sample_interval.load(std::memory_order_relaxed);
+}
+
+void StatPhase::set_malloc_backend(const MallocBackend& backend) {
+    if(in_measurement()) {
+        throw std::runtime_error(
+            "The malloc backend must be set outside of any "
+            "stat measurements!");
+    }
+
+    if(&backend == &tdc::libc_backend) {
+        malloc_callback::backend = nullptr;
+        return;
+    }
+
+#ifdef MALLOC_HEADERLESS
+    throw std::runtime_error(
+        "Malloc backends are not supported in headerless mode!");
+#else
+    const MallocBackend* expected = nullptr;
+    if(!malloc_callback::custom_backend.compare_exchange_strong(
+        expected, &backend) && expected != &backend) {
+
+        throw std::runtime_error(
+            "Only one malloc backend other than libc may be used!");
+    }
+    malloc_callback::backend = &backend;
+#endif
+}
+
+const MallocBackend& StatPhase::malloc_backend() {
+    const MallocBackend* backend =
+        malloc_callback::backend.load(std::memory_order_relaxed);
+    return backend ? *backend : tdc::libc_backend;
+}
+
+bool malloc_callback::on_alloc(size_t size, size_t bytes) {
+    return StatPhase::track_alloc(size, bytes);
 }
 
 void malloc_callback::on_free(size_t bytes) {
     StatPhase::track_free(bytes);
 }
 
+static_assert(
+    int(malloc_callback::CALL_MALLOC) == int(StatPhase::CALL_MALLOC) &&
+    int(malloc_callback::CALL_FREE) == int(StatPhase::CALL_FREE) &&
+    int(malloc_callback::CALL_REALLOC) == int(StatPhase::CALL_REALLOC) &&
+    int(malloc_callback::CALL_CALLOC) == int(StatPhase::CALL_CALLOC),
+    "allocation calls must be numbered consistently");
+
+void malloc_callback::on_call(call_t call) {
+    StatPhase::track_call(StatPhase::alloc_call_t(call));
+}
+
+void malloc_callback::on_lifetime(uint64_t nanoseconds, size_t phases) {
+    StatPhase::track_lifetime(nanoseconds, phases);
+}
+
+void malloc_callback::on_block_alloc(void* ptr, size_t size) {
+    StatPhase::track_block_alloc(ptr, size);
+}
+
+void malloc_callback::on_block_free(void* ptr) {
+    StatPhase::track_block_free(ptr);
+}
+
+void malloc_callback::on_map(void* addr, size_t length, bool anonymous) {
+    if(anonymous) {
+        StatPhase::track_map(addr, length);
+    } else {
+        // the new mapping may replace a tracked one
+        StatPhase::track_unmap(addr, length);
+    }
+}
+
+void malloc_callback::on_unmap(void* addr, size_t length) {
+    StatPhase::track_unmap(addr, length);
+}
+
+void malloc_callback::on_remap(void* old_addr, size_t old_length,
+                               void* new_addr, size_t new_length) {
+
+    if(StatPhase::track_unmap(old_addr, old_length)) {
+        StatPhase::track_map(new_addr, new_length);
+    }
+}
+
 #else
 
 void StatPhase::force_malloc_override_link() {
 }
 
+void StatPhase::count_finished_phase() {
+}
+
+void StatPhase::set_sample_interval(size_t) {
+}
+
+size_t StatPhase::sample_interval() {
+    return 0;
+}
+
+void StatPhase::set_malloc_backend(const MallocBackend&) {
+}
+
+const MallocBackend& StatPhase::malloc_backend() {
+    return tdc::libc_backend;
+}
+
 #endif
 
 #endif
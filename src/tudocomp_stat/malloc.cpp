@@ -1,6 +1,20 @@
 #include <tudocomp_stat/malloc.hpp>
+#include <tudocomp_stat/MallocBackend.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <malloc.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifndef MALLOC_DISABLED
 #ifdef __CYGWIN__
@@ -11,81 +25,864 @@
 
 #ifndef __MACH__
 
-constexpr size_t MEMBLOCK_MAGIC = 0xFEDCBA9876543210;
+// the alignment guaranteed by malloc
+constexpr size_t DEFAULT_ALIGNMENT = alignof(std::max_align_t);
+
+inline bool is_power_of_two(size_t x) {
+    return x && !(x & (x - 1));
+}
+
+__attribute__((tls_model("initial-exec")))
+thread_local bool t_within_call = false;
+
+// Guards the call of an allocation function. Only the outermost call of a
+// thread is counted, so allocation functions may call each other. Also
+// records the frame of the outermost call, which is where call site
+// capturing starts unwinding.
+struct call_guard {
+    bool outermost = false;
+
+    inline call_guard(void* frame, malloc_callback::call_t call) {
+        if(!t_within_call) {
+            t_within_call = true;
+            outermost = true;
+
+            if(malloc_callback::record_frames.load(
+                std::memory_order_relaxed)) {
+
+                malloc_callback::allocation_frame = frame;
+            }
+            malloc_callback::on_call(call);
+        }
+    }
+
+    inline ~call_guard() {
+        if(outermost) {
+            malloc_callback::allocation_frame = nullptr;
+            t_within_call = false;
+        }
+    }
+};
+
+// Releases the block of a refused allocation, see StatPhase::set_budget.
+inline void* refuse(void* ptr, const tdc::MallocBackend* backend, size_t size) {
+    if(backend) {
+        backend->free(ptr, size);
+    } else {
+        __libc_free(ptr);
+    }
+    errno = ENOMEM;
+    return NULL;
+}
+
+// Reports the address of an allocated block, if requested.
+inline void* report_block(void* ptr, size_t size) {
+    if(malloc_callback::record_blocks.load(std::memory_order_relaxed)) {
+        malloc_callback::on_block_alloc(ptr, size);
+    }
+    return ptr;
+}
+
+inline void report_block_free(void* ptr) {
+    if(malloc_callback::record_blocks.load(std::memory_order_relaxed)) {
+        malloc_callback::on_block_free(ptr);
+    }
+}
+
+#ifdef MALLOC_HEADERLESS
+
+// Headerless tracking.
+//
+// The size of a block is not stored, but queried from the underlying
+// allocator using malloc_usable_size. This avoids the memory overhead of a
+// header per block, but tracks the usable rather than the requested size.
+// Also, blocks allocated before the override took effect cannot be told
+// apart and are tracked when freed.
+
+extern "C" void* malloc(size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+
+    if(!size) return NULL;
+
+    void* ptr = __libc_malloc(size);
+    if(!ptr) return ptr; // malloc failed
+
+    const size_t usable = malloc_usable_size(ptr);
+    if(!malloc_callback::on_alloc(usable, usable)) {
+        return refuse(ptr, nullptr, size);
+    }
+    return report_block(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+    if(!ptr) return;
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_FREE);
+
+    malloc_callback::on_free(malloc_usable_size(ptr));
+    report_block_free(ptr);
+    __libc_free(ptr);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_REALLOC);
+
+    if(!size) {
+        free(ptr);
+        return NULL;
+    } else if(!ptr) {
+        return malloc(size);
+    } else if(malloc_callback::refusing_budgets.load(std::memory_order_relaxed)) {
+        // the new block must be tracked before the old one is released
+        void* new_ptr = malloc(size);
+        if(!new_ptr) return new_ptr;
+
+        memcpy(new_ptr, ptr, std::min(size, malloc_usable_size(ptr)));
+        free(ptr);
+        return new_ptr;
+    } else {
+        const size_t old_size = malloc_usable_size(ptr);
+        void* new_ptr = __libc_realloc(ptr, size);
+        if(!new_ptr) return new_ptr; // realloc failed, ptr is still valid
+
+        malloc_callback::on_free(old_size);
+        report_block_free(ptr);
+        const size_t usable = malloc_usable_size(new_ptr);
+        malloc_callback::on_alloc(usable, usable);
+        return report_block(new_ptr, size);
+    }
+}
+
+// alignment must be a power of two
+static void* malloc_aligned(size_t alignment, size_t size) {
+    if(alignment <= DEFAULT_ALIGNMENT) return malloc(size);
+    if(!size) return NULL;
+
+    void* ptr = __libc_memalign(alignment, size);
+    if(!ptr) return ptr; // malloc failed
+
+    const size_t usable = malloc_usable_size(ptr);
+    if(!malloc_callback::on_alloc(usable, usable)) {
+        return refuse(ptr, nullptr, size);
+    }
+    return report_block(ptr, size);
+}
+
+static void* malloc_zeroed(size_t size) {
+    if(!size) return NULL;
+
+    void* ptr = __libc_calloc(1, size);
+    if(!ptr) return ptr; // malloc failed
+
+    const size_t usable = malloc_usable_size(ptr);
+    if(!malloc_callback::on_alloc(usable, usable)) {
+        return refuse(ptr, nullptr, size);
+    }
+    return report_block(ptr, size);
+}
+
+#else
+
+constexpr size_t MEMBLOCK_MAGIC = 0xFEDCBA9876543200;
+
+// flags stored in the lowest bits of the magic
+constexpr size_t MEMBLOCK_ALIGNED = 1; // see aligned_header_t
+constexpr size_t MEMBLOCK_SAMPLED = 2; // see sampled_header_t
+constexpr size_t MEMBLOCK_SKIPPED = 4; // not sampled, thus not tracked
+constexpr size_t MEMBLOCK_TIMED = 8; // see timed_header_t
+constexpr size_t MEMBLOCK_BACKEND = 16; // allocated by the custom backend
+constexpr size_t MEMBLOCK_FLAGS = 0xFF;
 
 struct block_header_t {
     size_t magic;
     size_t size;
 };
 
+// Blocks with an alignment beyond the default are allocated with the
+// requested alignment plus an offset of the same size, so the pointer
+// returned to the user keeps the alignment. The header is placed right
+// before that pointer and additionally holds the offset to the start of
+// the underlying block.
+struct aligned_header_t {
+    size_t offset;
+    block_header_t block;
+};
+
+// Blocks allocated while timestamps are recorded carry another header in
+// front of the block header (or the aligned header), which holds the time
+// and the number of finished phases at the allocation. This way, the
+// lifetime of a block can be determined when it is freed.
+struct timed_header_t {
+    uint64_t time;
+    size_t phases;
+};
+
+// Sampled blocks carry yet another header in front of the others, which
+// holds the weight the block was tracked with. This way, the block is
+// untracked with the same weight, even if the sample interval has changed
+// in the meantime.
+struct sampled_header_t {
+    size_t weight;
+    size_t reserved; // keeps the following headers aligned
+};
+
+inline block_header_t* header_of(void* ptr) {
+    return (block_header_t*)((char*)ptr - sizeof(block_header_t));
+}
+
 inline bool is_managed(block_header_t* block) {
-    return (block->magic == MEMBLOCK_MAGIC);
+    return ((block->magic & ~MEMBLOCK_FLAGS) == MEMBLOCK_MAGIC);
+}
+
+inline bool is_aligned(block_header_t* block) {
+    return (block->magic & MEMBLOCK_ALIGNED);
+}
+
+inline bool is_timed(block_header_t* block) {
+    return (block->magic & MEMBLOCK_TIMED);
+}
+
+inline timed_header_t* timed_of(block_header_t* block) {
+    const size_t offset = is_aligned(block) ? sizeof(size_t) : 0;
+    return (timed_header_t*)((char*)block - offset) - 1;
+}
+
+inline sampled_header_t* sampled_of(block_header_t* block) {
+    const size_t offset = (is_aligned(block) ? sizeof(size_t) : 0) +
+        (is_timed(block) ? sizeof(timed_header_t) : 0);
+    return (sampled_header_t*)((char*)block - offset) - 1;
+}
+
+// the amount of bytes in front of a block that is not aligned, given the
+// flags of its header
+inline size_t headers_size(size_t flags) {
+    return ((flags & MEMBLOCK_SAMPLED) ? sizeof(sampled_header_t) : 0) +
+        ((flags & MEMBLOCK_TIMED) ? sizeof(timed_header_t) : 0) +
+        sizeof(block_header_t);
+}
+
+// the start of the underlying block
+inline void* base_of(void* ptr) {
+    auto block = header_of(ptr);
+    if(is_aligned(block)) {
+        auto header =
+            (aligned_header_t*)((char*)ptr - sizeof(aligned_header_t));
+        return (char*)ptr - header->offset;
+    } else {
+        return (char*)ptr - headers_size(block->magic);
+    }
+}
+
+// the size of the underlying block
+inline size_t base_size_of(block_header_t* block) {
+    if(is_aligned(block)) {
+        auto header = (aligned_header_t*)((char*)block - sizeof(size_t));
+        return header->offset + block->size;
+    } else {
+        return headers_size(block->magic) + block->size;
+    }
+}
+
+// Allocator backends.
+//
+// New blocks are allocated by the backend selected using
+// StatPhase::set_malloc_backend, glibc by default. Blocks of another backend
+// are flagged, so they are released by that backend even after glibc has
+// been selected again.
+
+inline const tdc::MallocBackend* selected_backend() {
+    return malloc_callback::backend.load(std::memory_order_relaxed);
+}
+
+inline size_t backend_flags(const tdc::MallocBackend* backend) {
+    return backend ? MEMBLOCK_BACKEND : 0;
+}
+
+inline const tdc::MallocBackend* backend_of(block_header_t* block) {
+    return (block->magic & MEMBLOCK_BACKEND)
+        ? malloc_callback::custom_backend.load(std::memory_order_relaxed)
+        : nullptr;
+}
+
+inline void* backend_malloc(const tdc::MallocBackend* backend, size_t size) {
+    return backend ? backend->malloc(size) : __libc_malloc(size);
+}
+
+inline void* backend_memalign(
+    const tdc::MallocBackend* backend, size_t alignment, size_t size) {
+
+    return backend ? backend->memalign(alignment, size)
+                   : __libc_memalign(alignment, size);
+}
+
+inline void* backend_realloc(const tdc::MallocBackend* backend,
+    void* ptr, size_t old_size, size_t new_size) {
+
+    return backend ? backend->realloc(ptr, old_size, new_size)
+                   : __libc_realloc(ptr, new_size);
+}
+
+inline void backend_free(
+    const tdc::MallocBackend* backend, void* ptr, size_t size) {
+
+    if(backend) {
+        backend->free(ptr, size);
+    } else {
+        __libc_free(ptr);
+    }
+}
+
+inline uint64_t current_time_nanos() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return uint64_t(t.tv_sec) * 1000000000ULL + uint64_t(t.tv_nsec);
+}
+
+// Fills the timed header, the block header must be initialized.
+inline void stamp(block_header_t* block) {
+    auto timed = timed_of(block);
+    timed->time = current_time_nanos();
+    timed->phases =
+        malloc_callback::finished_phases.load(std::memory_order_relaxed);
+}
+
+// Reports the lifetime of a tracked block that is being freed.
+inline void track_lifetime(block_header_t* block) {
+    if(is_timed(block) && !(block->magic & MEMBLOCK_SKIPPED)) {
+        auto timed = timed_of(block);
+        malloc_callback::on_lifetime(current_time_nanos() - timed->time,
+            malloc_callback::finished_phases.load(std::memory_order_relaxed) -
+            timed->phases);
+    }
+}
+
+// Allocation sampling.
+//
+// If a sample interval R is set, allocated bytes are sampled like a Poisson
+// process with rate 1/R, i.e., a block of size s is sampled with probability
+// 1 - exp(-s/R). Only sampled blocks are tracked, using the weight
+// s / (1 - exp(-s/R)), so the tracked amounts are unbiased estimates.
+//
+// Each thread counts down the bytes until the next sample. Since the
+// distance between samples is exponentially distributed and thus memoryless,
+// a new distance is drawn after each sample, and whenever the interval the
+// countdown was drawn for has changed.
+
+__attribute__((tls_model("initial-exec")))
+thread_local uint64_t t_sample_rng = 0;
+
+__attribute__((tls_model("initial-exec")))
+thread_local size_t t_bytes_until_sample = 0;
+
+__attribute__((tls_model("initial-exec")))
+thread_local size_t t_sample_interval = 0;
+
+static size_t draw_sample_distance(size_t interval) {
+    if(!t_sample_rng) {
+        // seed using splitmix64 of the thread-local address
+        static std::atomic<uint64_t> s_seed(0x9E3779B97F4A7C15ULL);
+        uint64_t z = s_seed.fetch_add(0x9E3779B97F4A7C15ULL) ^
+            uint64_t(uintptr_t(&t_sample_rng));
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        t_sample_rng = (z ^ (z >> 31)) | 1;
+    }
+
+    // xorshift64
+    t_sample_rng ^= t_sample_rng << 13;
+    t_sample_rng ^= t_sample_rng >> 7;
+    t_sample_rng ^= t_sample_rng << 17;
+
+    // uniform in (0, 1]
+    const double u = double((t_sample_rng >> 11) + 1) / double(1ULL << 53);
+    return size_t(-std::log(u) * double(interval)) + 1;
+}
+
+static bool sample(size_t size, size_t interval) {
+    if(interval != t_sample_interval) {
+        // the first allocation of a thread, or the first one after the
+        // interval has changed, only starts the countdown
+        t_sample_interval = interval;
+        t_bytes_until_sample = draw_sample_distance(interval);
+    }
+
+    if(size < t_bytes_until_sample) {
+        t_bytes_until_sample -= size;
+        return false;
+    }
+
+    t_bytes_until_sample = draw_sample_distance(interval);
+    return true;
+}
+
+// Decides whether a new block is sampled, which determines the flags for
+// its header and the amount of bytes it is tracked with.
+inline size_t sample_flags(size_t size, size_t& bytes) {
+    const size_t interval =
+        malloc_callback::sample_interval.load(std::memory_order_relaxed);
+
+    if(!interval) {
+        bytes = size;
+        return 0;
+    } else if(sample(size, interval)) {
+        bytes = malloc_callback::sample_weight(size, interval);
+        return MEMBLOCK_SAMPLED;
+    } else {
+        bytes = 0;
+        return MEMBLOCK_SKIPPED;
+    }
+}
+
+// Determines the flags for the header of a new block and the amount of bytes
+// it is tracked with.
+inline size_t block_flags(size_t size, size_t& bytes) {
+    const size_t timed =
+        malloc_callback::record_times.load(std::memory_order_relaxed)
+        ? MEMBLOCK_TIMED : 0;
+    return timed | sample_flags(size, bytes);
+}
+
+// Tracks the allocation of a block, returns false if it is refused.
+inline bool track_alloc(size_t size, size_t flags, size_t bytes) {
+    return (flags & MEMBLOCK_SKIPPED) ||
+        malloc_callback::on_alloc(size, bytes);
+}
+
+// the amount of bytes a block is tracked with, zero if it is not tracked
+inline size_t tracked_size(block_header_t* block) {
+    if(block->magic & MEMBLOCK_SAMPLED) {
+        return sampled_of(block)->weight;
+    } else if(block->magic & MEMBLOCK_SKIPPED) {
+        return 0;
+    } else {
+        return block->size;
+    }
+}
+
+inline void track_free(size_t bytes) {
+    if(bytes) malloc_callback::on_free(bytes);
+}
+
+// Initializes the headers of a block, the flags include those of the
+// backend.
+inline void init_block(
+    block_header_t* block, size_t size, size_t flags, size_t bytes) {
+
+    block->magic = MEMBLOCK_MAGIC | flags;
+    block->size = size;
+    if(flags & MEMBLOCK_TIMED) stamp(block);
+    if(flags & MEMBLOCK_SAMPLED) sampled_of(block)->weight = bytes;
+}
+
+// Initializes the headers of a block that is not aligned, returns the
+// pointer for the user.
+inline void* make_block(void* ptr, size_t size, size_t flags, size_t bytes,
+    const tdc::MallocBackend* backend) {
+
+    if(!track_alloc(size, flags, bytes)) {
+        return refuse(ptr, backend, size + headers_size(flags));
+    }
+
+    auto block = (block_header_t*)((char*)ptr + headers_size(flags) -
+        sizeof(block_header_t));
+    init_block(block, size, flags | backend_flags(backend), bytes);
+
+    return report_block((char*)block + sizeof(block_header_t), size);
+}
+
+// Allocates a block that is not aligned with the given flags, returns the
+// pointer for the user.
+static void* allocate(size_t size, size_t flags, size_t bytes) {
+    if(size > SIZE_MAX - headers_size(flags)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    const tdc::MallocBackend* backend = selected_backend();
+    void *ptr = backend_malloc(backend, size + headers_size(flags));
+    if(!ptr) return ptr; // malloc failed
+
+    return make_block(ptr, size, flags, bytes, backend);
 }
 
 extern "C" void* malloc(size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+
     if(!size) return NULL;
 
-    void *ptr = __libc_malloc(size + sizeof(block_header_t));
-    if(!ptr) return ptr; // malloc failed
+    size_t bytes;
+    const size_t flags = block_flags(size, bytes);
+    return allocate(size, flags, bytes);
+}
 
-    auto block = (block_header_t*)ptr;
-    block->magic = MEMBLOCK_MAGIC;
-    block->size = size;
+// Allocates a zeroed block. glibc's calloc knows which memory is fresh from
+// the system and thus zero already, so large blocks are not touched and
+// their pages are only committed on first use.
+static void* malloc_zeroed(size_t size) {
+    if(!size) return NULL;
 
-    malloc_callback::on_alloc(size);
+    size_t bytes;
+    const size_t flags = block_flags(size, bytes);
+    if(size > SIZE_MAX - headers_size(flags)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    const size_t total = size + headers_size(flags);
 
-    return (char*)ptr + sizeof(block_header_t);
+    void* ptr;
+    const tdc::MallocBackend* backend = selected_backend();
+    if(backend) {
+        // backends cannot tell whether a block is zero
+        ptr = backend->malloc(total);
+        if(ptr) memset(ptr, 0, total);
+    } else {
+        ptr = __libc_calloc(1, total);
+    }
+    if(!ptr) return ptr; // malloc failed
+
+    return make_block(ptr, size, flags, bytes, backend);
 }
 
 extern "C" void free(void* ptr) {
     if(!ptr) return;
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_FREE);
 
-    auto block = (block_header_t*)((char*)ptr - sizeof(block_header_t));
+    auto block = header_of(ptr);
     if(is_managed(block)) {
-        malloc_callback::on_free(block->size);
-        __libc_free(block);
+        track_free(tracked_size(block));
+        track_lifetime(block);
+        report_block_free(ptr);
+        backend_free(backend_of(block), base_of(ptr), base_size_of(block));
     } else {
         __libc_free(ptr);
     }
 }
 
 extern "C" void* realloc(void* ptr, size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_REALLOC);
+
     if(!size) {
         free(ptr);
         return NULL;
     } else if(!ptr) {
         return malloc(size);
     } else {
-        auto block = (block_header_t*)((char*)ptr - sizeof(block_header_t));
-        if(is_managed(block)) {
-            size_t old_size = block->size;
-            void *new_ptr = __libc_realloc(block, size + sizeof(block_header_t));
+        auto block = header_of(ptr);
+        if(is_managed(block) && !is_aligned(block) &&
+           !malloc_callback::refusing_budgets.load(std::memory_order_relaxed)) {
+            // the block keeps its timed header and backend, if any, but is
+            // sampled anew
+            const size_t old_magic = block->magic;
+            const size_t old_bytes = tracked_size(block);
+
+            size_t bytes;
+            const size_t flags =
+                (old_magic & MEMBLOCK_TIMED) | sample_flags(size, bytes);
+
+            if((flags ^ old_magic) & MEMBLOCK_SAMPLED) {
+                // the headers change, so the contents are copied
+                void* new_ptr = allocate(size, flags, bytes);
+                if(!new_ptr) return new_ptr;
+
+                if(flags & MEMBLOCK_TIMED) {
+                    *timed_of(header_of(new_ptr)) = *timed_of(block);
+                }
+                memcpy(new_ptr, ptr, std::min(size, block->size));
+
+                track_free(old_bytes);
+                report_block_free(ptr);
+                backend_free(backend_of(block), base_of(ptr),
+                    base_size_of(block));
+                return new_ptr;
+            }
+
+            if(size > SIZE_MAX - headers_size(flags)) {
+                errno = ENOMEM;
+                return NULL;
+            }
+
+            void *new_ptr = backend_realloc(backend_of(block), base_of(ptr),
+                base_size_of(block), size + headers_size(flags));
+            if(!new_ptr) return new_ptr; // realloc failed, ptr is still valid
+
+            track_free(old_bytes);
+            report_block_free(ptr);
 
-            auto new_block = (block_header_t*)new_ptr;
-            new_block->magic = MEMBLOCK_MAGIC; // just making sure
+            // no budget refuses allocations, so the block is tracked
+            track_alloc(size, flags, bytes);
+
+            auto new_block = (block_header_t*)((char*)new_ptr +
+                headers_size(flags) - sizeof(block_header_t));
+            new_block->magic = MEMBLOCK_MAGIC |
+                (old_magic & MEMBLOCK_BACKEND) | flags;
             new_block->size = size;
+            if(flags & MEMBLOCK_SAMPLED) sampled_of(new_block)->weight = bytes;
 
-            malloc_callback::on_free(old_size);
-            malloc_callback::on_alloc(size);
+            return report_block(
+                (char*)new_block + sizeof(block_header_t), size);
+        } else if(is_managed(block)) {
+            // realloc does not need to keep the alignment, and the new
+            // block must be tracked before the old one is released
+            void* new_ptr = malloc(size);
+            if(!new_ptr) return new_ptr;
 
-            return (char*)new_ptr + sizeof(block_header_t);
+            memcpy(new_ptr, ptr, std::min(size, block->size));
+            free(ptr);
+            return new_ptr;
         } else {
             return __libc_realloc(ptr, size);
         }
     }
 }
 
-extern "C" void* calloc(size_t num, size_t size) {
-    size *= num;
+// alignment must be a power of two
+static void* malloc_aligned(size_t alignment, size_t size) {
+    if(alignment <= DEFAULT_ALIGNMENT) return malloc(size);
     if(!size) return NULL;
 
-    void* ptr = malloc(size);
-    memset(ptr, 0, size);
+    static_assert(sizeof(aligned_header_t) <= 2 * DEFAULT_ALIGNMENT,
+        "aligned header must fit into the smallest offset");
+
+    size_t bytes;
+    const size_t flags = block_flags(size, bytes);
+
+    // the offset is a multiple of the alignment that fits all headers
+    const size_t headers = headers_size(flags) + sizeof(size_t);
+
+    size_t offset = alignment;
+    while(offset < headers) offset += alignment;
+    if(size > SIZE_MAX - offset) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    const tdc::MallocBackend* backend = selected_backend();
+    void* ptr = backend_memalign(backend, alignment, size + offset);
+    if(!ptr) return ptr; // malloc failed
+
+    if(!track_alloc(size, flags, bytes)) return refuse(ptr, backend, size + offset);
+
+    void* user_ptr = (char*)ptr + offset;
+    auto header = (aligned_header_t*)((char*)user_ptr - sizeof(aligned_header_t));
+    header->offset = offset;
+    init_block(&header->block, size,
+        MEMBLOCK_ALIGNED | backend_flags(backend) | flags, bytes);
+
+    return report_block(user_ptr, size);
+}
+
+// C++ allocation.
+//
+// The replacements of the global operator new and delete use the same
+// blocks as malloc. However, the sized variants of operator delete receive
+// the size of the block, so it can be tracked without reading the header
+// first. This only works as long as blocks carry no sampling flags and no
+// timestamps, are allocated by glibc and their addresses need not be
+// reported, i.e., none of this has ever been enabled.
+//
+// Over-aligned allocations use the default implementations, which are
+// based on aligned_alloc and free. Thus, only blocks of new_block reach the
+// sized operator delete and their header is not checked.
+
+static void* new_block(size_t size) {
+    if(!size) size = 1; // new must return a unique pointer
+
+    for(;;) {
+        void* ptr = malloc(size);
+        if(ptr) return ptr;
+
+        std::new_handler handler = std::get_new_handler();
+        if(!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+static void delete_sized_block(void* ptr, size_t size) {
+    if(!ptr) return;
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_FREE);
+
+    if(malloc_callback::sampling_used.load(std::memory_order_relaxed) ||
+       malloc_callback::record_times.load(std::memory_order_relaxed) ||
+       malloc_callback::record_blocks.load(std::memory_order_relaxed) ||
+       malloc_callback::custom_backend.load(std::memory_order_relaxed)) {
+        free(ptr);
+    } else {
+        malloc_callback::on_free(size ? size : 1);
+        __libc_free(header_of(ptr));
+    }
+}
+
+void* operator new(size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+    return new_block(size);
+}
+
+void* operator new[](size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+    return new_block(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+    try {
+        return new_block(size);
+    } catch(const std::bad_alloc&) {
+        return NULL;
+    }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+    try {
+        return new_block(size);
+    } catch(const std::bad_alloc&) {
+        return NULL;
+    }
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+    delete_sized_block(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+    delete_sized_block(ptr, size);
+}
+
+#endif
+
+extern "C" void* calloc(size_t num, size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_CALLOC);
+
+    size_t bytes;
+    if(__builtin_mul_overflow(num, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return malloc_zeroed(bytes);
+}
+
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+
+    if(!is_power_of_two(alignment) || alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+
+    void* ptr = malloc_aligned(alignment, size);
+    if(!ptr && size) return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+
+    if(!is_power_of_two(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return malloc_aligned(alignment, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+
+    // like glibc, round up to the next power of two, if there is one
+    if(alignment > SIZE_MAX / 2 + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t a = DEFAULT_ALIGNMENT;
+    while(a < alignment) a <<= 1;
+    return malloc_aligned(a, size);
+}
+
+extern "C" void* valloc(size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+
+    return malloc_aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+extern "C" void* pvalloc(size_t size) {
+    call_guard guard(__builtin_frame_address(0), malloc_callback::CALL_MALLOC);
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    return malloc_aligned(page_size,
+        (size + page_size - 1) / page_size * page_size);
+}
+
+#if defined(__linux__) && defined(__LP64__)
+
+// Memory mappings.
+//
+// The system calls are issued directly, since glibc does not export
+// internal entry points for all of them. glibc's own allocator does not
+// call these overrides, so its mappings are not tracked twice.
+//
+// Only 64-bit systems are supported, where the mmap system call takes the
+// offset in bytes and mmap64 is the same as mmap.
+
+extern "C" void* mmap(
+    void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+
+    void* ptr = (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+    if(ptr == MAP_FAILED) return ptr;
+
+    malloc_callback::on_map(ptr, length, flags & MAP_ANONYMOUS);
+    return ptr;
+}
+
+extern "C" void* mmap64(
+    void* addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+extern "C" int munmap(void* addr, size_t length) {
+    const int result = syscall(SYS_munmap, addr, length);
+    if(result == 0) malloc_callback::on_unmap(addr, length);
+    return result;
+}
+
+extern "C" void* mremap(
+    void* old_addr, size_t old_length, size_t new_length, int flags, ...) {
+
+    void* new_addr = NULL;
+    if(flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        new_addr = va_arg(args, void*);
+        va_end(args);
+    }
+
+    void* ptr = (void*)syscall(
+        SYS_mremap, old_addr, old_length, new_length, flags, new_addr);
+    if(ptr == MAP_FAILED) return ptr;
+
+    malloc_callback::on_remap(old_addr, old_length, ptr, new_length);
     return ptr;
 }
 
 #endif
 
+#endif
+
 #endif
 #endif
 
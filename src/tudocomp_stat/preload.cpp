@@ -0,0 +1,244 @@
+// Measurement of unmodified programs.
+//
+// This is built as libtudocomp_stat_preload.so, which is loaded into a
+// program using LD_PRELOAD. It installs the malloc overrides and measures
+// the program in an implicit root phase, which is written as JSON when the
+// program exits. The following environment variables are recognized:
+//
+// TDC_STAT_OUTPUT           the output file, "%p" is replaced by the process
+//                           ID (default: standard error)
+// TDC_STAT_TITLE            the title of the root phase (default: the
+//                           program name)
+// TDC_STAT_SIGNAL           a signal (number or name, e.g., USR1) starting a
+//                           new sub phase of the root phase when received
+// TDC_STAT_BUFFER_SIZE      see StatPhase::set_thread_buffer_size
+// TDC_STAT_SAMPLE_INTERVAL  see StatPhase::set_sample_interval
+// TDC_STAT_BUDGET           a memory budget in bytes for the root phase,
+//                           exceeding it is logged (see StatPhase::set_budget)
+// TDC_STAT_MALLOC_BACKEND   the allocator underlying the override, "libc"
+//                           (default) or "size_class"
+// TDC_STAT_CLOCK            the source of timestamps, "monotonic" (default)
+//                           or "tsc" (see StatPhase::set_time_source)
+
+#include <tudocomp_stat/StatPhase.hpp>
+
+#ifndef STATS_DISABLED
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+using tdc::StatPhase;
+
+extern char* program_invocation_short_name;
+
+namespace {
+
+const char* env(const char* name) {
+    const char* value = getenv(name);
+    return (value && *value) ? value : nullptr;
+}
+
+int parse_signal(const char* name) {
+    static const struct { const char* name; int signal; } signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM},
+        {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"WINCH", SIGWINCH},
+    };
+
+    if(strncmp(name, "SIG", 3) == 0) name += 3;
+    for(auto& s : signals) {
+        if(strcmp(name, s.name) == 0) return s.signal;
+    }
+    return atoi(name);
+}
+
+// The phases are owned by a dedicated thread, so they can be started
+// whenever a signal arrives. All threads of the program account their
+// allocations via their thread buffers.
+class preload_t {
+private:
+    pid_t m_pid;
+    std::string m_title;
+    std::string m_output;
+    size_t m_budget = 0;
+
+    // duplicate of stderr, which programs may close before exiting
+    int m_stderr = -1;
+
+    sem_t m_started;
+    sem_t m_wakeup;
+    std::atomic<bool> m_exiting {false};
+    std::atomic<size_t> m_signals {0};
+
+    // allocated, so it is never destroyed in a forked child
+    std::thread* m_owner = nullptr;
+
+    static preload_t* s_instance;
+
+    static void on_signal(int) {
+        s_instance->m_signals++;
+        sem_post(&s_instance->m_wakeup);
+    }
+
+    static void wait(sem_t* sem) {
+        while(sem_wait(sem) != 0 && errno == EINTR) {
+        }
+    }
+
+    void write(const tdc::json& data) {
+        std::string path = m_output;
+        const size_t pos = path.find("%p");
+        if(pos != std::string::npos) {
+            path.replace(pos, 2, std::to_string(m_pid));
+        }
+
+        FILE* f = path.empty()
+            ? fdopen(m_stderr, "w") : fopen(path.c_str(), "w");
+        if(!f) {
+            fprintf(stderr, "tudocomp_stat: cannot write %s: %s\n",
+                path.c_str(), strerror(errno));
+            return;
+        }
+
+        const std::string json = data.dump(4);
+        fwrite(json.data(), 1, json.size(), f);
+        fputc('\n', f);
+        fclose(f);
+    }
+
+    void run() {
+        tdc::json data;
+        {
+            // storage for the signal phases, allocated outside of any phase
+            void* storage = operator new(sizeof(StatPhase));
+            StatPhase* phase = nullptr;
+
+            std::string root_title = m_title;
+            StatPhase root(std::move(root_title));
+            if(m_budget) root.set_budget(m_budget);
+            sem_post(&m_started);
+
+            size_t handled = 0;
+            while(!m_exiting) {
+                wait(&m_wakeup);
+
+                for(; handled < m_signals; handled++) {
+                    std::string title =
+                        "Signal " + std::to_string(handled + 1);
+                    if(phase) {
+                        phase->split(std::move(title));
+                    } else {
+                        phase = new(storage) StatPhase(std::move(title));
+                    }
+                }
+            }
+
+            if(phase) phase->~StatPhase();
+            data = root.to_json();
+            operator delete(storage);
+        }
+        write(data);
+    }
+
+public:
+    preload_t() {
+        m_pid = getpid();
+
+        const char* title = env("TDC_STAT_TITLE");
+        m_title = title ? title : program_invocation_short_name;
+
+        const char* output = env("TDC_STAT_OUTPUT");
+        if(output) m_output = output;
+        else m_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+
+        if(const char* budget = env("TDC_STAT_BUDGET")) {
+            m_budget = strtoull(budget, nullptr, 10);
+        }
+        if(const char* size = env("TDC_STAT_BUFFER_SIZE")) {
+            StatPhase::set_thread_buffer_size(strtoull(size, nullptr, 10));
+        }
+        if(const char* interval = env("TDC_STAT_SAMPLE_INTERVAL")) {
+            try {
+                StatPhase::set_sample_interval(
+                    strtoull(interval, nullptr, 10));
+            } catch(const std::exception& e) {
+                fprintf(stderr, "tudocomp_stat: %s\n", e.what());
+            }
+        }
+        if(const char* name = env("TDC_STAT_MALLOC_BACKEND")) {
+            if(!strcmp(name, tdc::size_class_backend.name)) {
+                try {
+                    StatPhase::set_malloc_backend(tdc::size_class_backend);
+                } catch(const std::exception& e) {
+                    fprintf(stderr, "tudocomp_stat: %s\n", e.what());
+                }
+            } else if(strcmp(name, tdc::libc_backend.name)) {
+                fprintf(stderr,
+                    "tudocomp_stat: unknown malloc backend: %s\n", name);
+            }
+        }
+
+        if(const char* name = env("TDC_STAT_CLOCK")) {
+            if(!strcmp(name, "tsc")) {
+                if(!StatPhase::set_time_source(StatPhase::TIME_TSC)) {
+                    fprintf(stderr, "tudocomp_stat: the time stamp counter "
+                        "is not usable, using the monotonic clock\n");
+                }
+            } else if(strcmp(name, "monotonic")) {
+                fprintf(stderr, "tudocomp_stat: unknown clock: %s\n", name);
+            }
+        }
+
+        s_instance = this;
+        sem_init(&m_started, 0, 0);
+        sem_init(&m_wakeup, 0, 0);
+
+        if(const char* name = env("TDC_STAT_SIGNAL")) {
+            const int sig = parse_signal(name);
+
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = &preload_t::on_signal;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            if(sig <= 0 || sigaction(sig, &action, nullptr) != 0) {
+                fprintf(stderr, "tudocomp_stat: invalid signal: %s\n", name);
+            }
+        }
+
+        // wait for the root phase, so it covers everything from here on
+        m_owner = new std::thread([this](){ run(); });
+        wait(&m_started);
+    }
+
+    ~preload_t() {
+        // forked children have no owner thread and write nothing
+        if(getpid() != m_pid) return;
+
+        m_exiting = true;
+        sem_post(&m_wakeup);
+        m_owner->join();
+        delete m_owner;
+    }
+};
+
+preload_t* preload_t::s_instance = nullptr;
+
+// destroyed after the static objects of the program, since it is
+// constructed before them
+preload_t s_preload;
+
+}
+
+#endif
@@ -0,0 +1,578 @@
+#include <gtest/gtest.h>
+
+#include <tudocomp_stat/StatPhase.hpp>
+#include <tudocomp_stat/AllocHistogram.hpp>
+#include <tudocomp_stat/AllocLifetimes.hpp>
+#include <tudocomp_stat/CallSites.hpp>
+#include <tudocomp_stat/LiveAllocations.hpp>
+#include <tudocomp_stat/MemTimeline.hpp>
+#include <tudocomp_stat/PerfCounters.hpp>
+#include <tudocomp_stat/ProcessIO.hpp>
+#include <tudocomp_stat/ResourceUsage.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace tdc;
+
+// Extensions cannot be unregistered, so they are tested separately from the
+// basic phase tests.
+
+// Returns the value of the given user statistic of a phase.
+static json stat(const json& phase, const std::string& key) {
+    for(auto& entry : phase["stats"]) {
+        if(entry["key"] == key) return entry["value"];
+    }
+    return json();
+}
+
+TEST(Extensions, alloc_histogram) {
+    StatPhase::register_extension<AllocHistogram>();
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase sub1("sub1");
+            for(size_t i = 0; i < 10; i++) {
+                std::make_unique<char[]>(100);
+            }
+            std::make_unique<char[]>(5000);
+        }
+        std::make_unique<char[]>(3000);
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    auto h1 = stat(j["sub"][0], "allocHistogram");
+    ASSERT_EQ(h1.size(), 2U);
+    ASSERT_EQ(int(h1[0]["minSize"]), 64);
+    ASSERT_EQ(int(h1[0]["count"]), 10);
+    ASSERT_GE(int(h1[0]["bytes"]), 1000);
+    ASSERT_EQ(int(h1[1]["minSize"]), 4096);
+    ASSERT_EQ(int(h1[1]["count"]), 1);
+
+    // the root includes its sub phase
+    auto h = stat(j, "allocHistogram");
+    ASSERT_EQ(h.size(), 3U);
+    ASSERT_EQ(int(h[0]["count"]), 10);
+    ASSERT_EQ(int(h[1]["minSize"]), 2048);
+    ASSERT_EQ(int(h[1]["count"]), 1);
+    ASSERT_EQ(int(h[2]["count"]), 1);
+}
+
+#ifndef MALLOC_HEADERLESS
+TEST(Extensions, alloc_histogram_sampled) {
+    constexpr size_t interval = 4096;
+    constexpr size_t num_blocks = 10000;
+
+    StatPhase::set_sample_interval(interval);
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        for(size_t i = 0; i < num_blocks; i++) {
+            std::make_unique<char[]>(64);
+        }
+        j = root.to_json();
+    }
+    StatPhase::set_sample_interval(0);
+    std::cout << j.dump(4) << std::endl;
+
+    // sampled blocks stay in the bucket of their size, and each stands for
+    // about interval / 64 blocks, so the standard deviation of the count is
+    // about sqrt(num_blocks * interval / 64)
+    auto h = stat(j, "allocHistogram");
+    ASSERT_EQ(h.size(), 1U);
+    ASSERT_EQ(int(h[0]["minSize"]), 64);
+    ASSERT_NEAR(double(h[0]["count"]), double(num_blocks), 3200.0);
+    ASSERT_NEAR(double(h[0]["bytes"]), double(num_blocks * 64), 3200.0 * 64);
+}
+#endif
+
+__attribute__((noinline)) static void* allocate_at_call_site(size_t size) {
+    void* volatile p = malloc(size);
+    return p;
+}
+
+TEST(Extensions, call_sites) {
+    StatPhase::register_extension<CallSites>();
+
+    std::vector<void*> blocks;
+    blocks.reserve(6);
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase sub1("sub1");
+            for(size_t i = 0; i < 5; i++) {
+                blocks.push_back(allocate_at_call_site(1000));
+            }
+            blocks.push_back(malloc(3000));
+        }
+        j = root.to_json();
+    }
+    for(void* p : blocks) free(p);
+    std::cout << j.dump(4) << std::endl;
+
+    auto sites = stat(j["sub"][0], "callSites");
+    ASSERT_EQ(sites["byCount"].size(), 2U);
+    ASSERT_EQ(int(sites["byCount"][0]["count"]), 5);
+    ASSERT_GE(int(sites["byCount"][0]["bytes"]), 5000);
+    ASSERT_EQ(int(sites["byBytes"][0]["count"]), 5);
+    ASSERT_EQ(int(sites["byBytes"][1]["count"]), 1);
+    ASSERT_GT(sites["byCount"][0]["frames"].size(), 0U);
+    ASSERT_GT(sites["maps"].size(), 0U);
+
+    // the root includes its sub phase
+    auto root_sites = stat(j, "callSites");
+    ASSERT_EQ(int(root_sites["byCount"][0]["count"]), 5);
+}
+
+TEST(Extensions, call_sites_threads) {
+    constexpr size_t num_threads = 4;
+    constexpr size_t num_allocs = 100;
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        for(size_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&](){
+                for(size_t i = 0; i < num_allocs; i++) {
+                    free(allocate_at_call_site(100));
+                }
+            });
+        }
+        for(auto& thread : threads) thread.join();
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    // the threads share the call site
+    auto sites = stat(j, "callSites");
+    ASSERT_EQ(int(sites["byCount"][0]["count"]), int(num_threads * num_allocs));
+    ASSERT_GE(int(sites["byCount"][0]["bytes"]),
+        int(num_threads * num_allocs * 100));
+}
+
+#ifndef MALLOC_HEADERLESS
+// Returns the total count of a histogram.
+static int total_count(const json& histogram) {
+    int count = 0;
+    for(auto& bucket : histogram) count += int(bucket["count"]);
+    return count;
+}
+
+TEST(Extensions, alloc_lifetimes) {
+    StatPhase::register_extension<AllocLifetimes>();
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        void* volatile survivor = malloc(100);
+        {
+            tdc::StatPhase sub1("sub1");
+            for(size_t i = 0; i < 10; i++) {
+                void* volatile p = malloc(100);
+                free(p);
+            }
+            sub1.split("sub2");
+            free(survivor);
+        }
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    auto l1 = stat(j["sub"][0], "allocLifetimes");
+    ASSERT_EQ(total_count(l1["byTime"]), 10);
+    ASSERT_EQ(l1["byPhases"].size(), 1U);
+    ASSERT_EQ(int(l1["byPhases"][0]["minPhases"]), 0);
+    ASSERT_EQ(int(l1["byPhases"][0]["count"]), 10);
+
+    // the survivor was allocated before sub1 finished
+    auto l2 = stat(j["sub"][1], "allocLifetimes");
+    ASSERT_EQ(total_count(l2["byTime"]), 1);
+    ASSERT_EQ(l2["byPhases"].size(), 1U);
+    ASSERT_EQ(int(l2["byPhases"][0]["minPhases"]), 1);
+
+    // the root includes its sub phases
+    auto l = stat(j, "allocLifetimes");
+    ASSERT_EQ(total_count(l["byTime"]), 11);
+    ASSERT_EQ(total_count(l["byPhases"]), 11);
+}
+#endif
+
+TEST(Extensions, live_allocations) {
+    StatPhase::register_extension<LiveAllocations>();
+
+    std::vector<void*> retained;
+    retained.reserve(3);
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase sub1("sub1");
+            for(size_t i = 0; i < 3; i++) {
+                retained.push_back(allocate_at_call_site(1000));
+            }
+            void* volatile p = malloc(500);
+            free(p);
+
+            sub1.split("sub2");
+            free(retained.back());
+            retained.pop_back();
+        }
+        j = root.to_json();
+    }
+    for(void* p : retained) free(p);
+    std::cout << j.dump(4) << std::endl;
+
+    auto l1 = stat(j["sub"][0], "liveAllocations");
+    ASSERT_EQ(int(l1["count"]), 3);
+    ASSERT_EQ(int(l1["bytes"]), 3000);
+    ASSERT_EQ(l1["bySite"].size(), 1U);
+    ASSERT_EQ(int(l1["bySite"][0]["count"]), 3);
+    ASSERT_GT(l1["bySite"][0]["frames"].size(), 0U);
+
+    auto l2 = stat(j["sub"][1], "liveAllocations");
+    ASSERT_EQ(int(l2["count"]), 0);
+
+    // the root includes its sub phases
+    auto l = stat(j, "liveAllocations");
+    ASSERT_EQ(int(l["count"]), 2);
+    ASSERT_EQ(int(l["bytes"]), 2000);
+}
+
+TEST(Extensions, live_allocations_threads) {
+    StatPhase::register_extension<LiveAllocations>();
+
+    void* volatile retained = nullptr;
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+
+        // a phase of its own, not a sub phase of the root
+        std::thread worker([&](){
+            tdc::StatPhase phase("Worker");
+            retained = malloc(1000);
+        });
+        worker.join();
+
+        j = root.to_json();
+    }
+    free(retained);
+    std::cout << j.dump(4) << std::endl;
+
+    // only the thread's own data, e.g. its TLS, may still be alive
+    auto l = stat(j, "liveAllocations");
+    ASSERT_LT(int(l["bytes"]), 1000);
+}
+
+// Returns the maximum peak of a memory timeline.
+static int max_peak(const json& timeline) {
+    int peak = 0;
+    for(auto& p : timeline) peak = std::max(peak, int(p["peak"]));
+    return peak;
+}
+
+TEST(Extensions, mem_timeline) {
+    StatPhase::register_extension<MemTimeline>();
+
+    // points are only recorded for changes of at least 10000 bytes
+    MemTimeline::set_min_delta(10000, 1e9);
+
+    std::vector<void*> blocks;
+    blocks.reserve(20);
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        void* volatile a = malloc(50000);
+        {
+            tdc::StatPhase sub1("sub1");
+            for(size_t i = 0; i < 10; i++) blocks.push_back(malloc(20000));
+            for(void* p : blocks) free(p);
+            blocks.clear();
+
+            MemTimeline::set_max_points(4);
+            sub1.split("sub2");
+            for(size_t i = 0; i < 20; i++) blocks.push_back(malloc(20000));
+            for(void* p : blocks) free(p);
+            blocks.clear();
+        }
+        free(a);
+        j = root.to_json();
+    }
+    MemTimeline::set_min_delta(64 * 1024, 1);
+    MemTimeline::set_max_points(1000);
+    std::cout << j.dump(4) << std::endl;
+
+    // one point per allocation and per free
+    auto t1 = stat(j["sub"][0], "memTimeline");
+    ASSERT_EQ(t1.size(), 20U);
+    ASSERT_EQ(max_peak(t1), int(j["sub"][0]["memPeak"]));
+    ASSERT_EQ(int(t1.back()["bytes"]), 0);
+    for(size_t i = 1; i < t1.size(); i++) {
+        ASSERT_GE(double(t1[i]["time"]), double(t1[i - 1]["time"]));
+    }
+
+    // downsampling keeps the peak
+    auto t2 = stat(j["sub"][1], "memTimeline");
+    ASSERT_LE(t2.size(), 4U);
+    ASSERT_EQ(max_peak(t2), int(j["sub"][1]["memPeak"]));
+    ASSERT_EQ(int(t2.back()["bytes"]), 0);
+
+    // the root includes its sub phases on top of its own memory
+    auto t = stat(j, "memTimeline");
+    ASSERT_EQ(max_peak(t), int(j["memPeak"]));
+    ASSERT_EQ(int(t.back()["bytes"]), 0);
+}
+
+TEST(Extensions, mem_timeline_threads) {
+    StatPhase::register_extension<MemTimeline>();
+    MemTimeline::set_min_delta(10000, 1e9);
+
+    constexpr size_t num_threads = 2;
+    json j;
+    {
+        tdc::StatPhase root("Root");
+
+        // the threads hold their blocks at the same time
+        std::atomic<size_t> allocated(0);
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t](){
+                auto attached = StatPhase::attach_thread(root, t);
+                tdc::StatPhase worker("worker");
+                void* volatile p = malloc(50000);
+                allocated++;
+                while(allocated.load() != num_threads) {
+                    std::this_thread::yield();
+                }
+                free(p);
+            });
+        }
+        for(auto& thread : threads) thread.join();
+        j = root.to_json();
+    }
+    MemTimeline::set_min_delta(64 * 1024, 1);
+    std::cout << j.dump(4) << std::endl;
+
+    // the timelines of the workers are merged by time
+    auto t = stat(j, "memTimeline");
+    int max_bytes = 0;
+    for(size_t i = 0; i < t.size(); i++) {
+        max_bytes = std::max(max_bytes, int(t[i]["bytes"]));
+    }
+    for(size_t i = 1; i < t.size(); i++) {
+        ASSERT_GE(double(t[i]["time"]), double(t[i - 1]["time"]));
+    }
+    ASSERT_GE(max_bytes, int(num_threads * 50000));
+    ASSERT_EQ(int(t.back()["bytes"]), int(j["memFinal"]));
+}
+
+TEST(Extensions, perf_counters) {
+    StatPhase::register_extension<PerfCounters>();
+
+    volatile uint64_t x = 0;
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase sub("sub");
+            for(size_t i = 0; i < 1000000; i++) x = x + i;
+        }
+        {
+            tdc::StatPhase paused("paused");
+            auto guard = StatPhase::suppress_tracking();
+            for(size_t i = 0; i < 1000000; i++) x = x + i;
+        }
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    auto p = stat(j, "perfCounters");
+    auto p_sub = stat(j["sub"][0], "perfCounters");
+    auto p_paused = stat(j["sub"][1], "perfCounters");
+    if(p.count("error")) {
+        // perf is not available, which is reported for every phase
+        ASSERT_TRUE(p["error"].is_string());
+        ASSERT_TRUE(p_sub.count("error"));
+        return;
+    }
+
+    if(p.count("instructions")) {
+        // the loop alone takes millions of instructions
+        const uint64_t sub_instr = p_sub["instructions"];
+        const uint64_t paused_instr = p_paused["instructions"];
+        ASSERT_GE(sub_instr, 1000000U);
+        ASSERT_LT(paused_instr, sub_instr / 2);
+
+        // the root includes its sub phases
+        ASSERT_GE(uint64_t(p["instructions"]), sub_instr + paused_instr);
+    }
+}
+
+// Counts its instances that have not been destroyed yet.
+class InstanceCounter : public StatPhaseExtension {
+public:
+    static std::atomic<int> s_instances;
+
+    InstanceCounter() {
+        ++s_instances;
+    }
+
+    virtual ~InstanceCounter() {
+        --s_instances;
+    }
+
+    virtual void write(json&) override {
+    }
+};
+
+std::atomic<int> InstanceCounter::s_instances(0);
+
+static size_t count_open_fds() {
+    size_t n = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    if(!dir) return 0;
+    while(readdir(dir)) n++;
+    closedir(dir);
+    return n;
+}
+
+TEST(Extensions, destroyed_with_phase) {
+    StatPhase::register_extension<InstanceCounter>();
+
+    // the performance counters of finished phases are closed, so this
+    // does not run out of file descriptors
+    const size_t fds = count_open_fds();
+    for(size_t i = 0; i < 1000; i++) {
+        tdc::StatPhase root("Root");
+        tdc::StatPhase sub("sub");
+    }
+    ASSERT_EQ(InstanceCounter::s_instances.load(), 0);
+    ASSERT_EQ(count_open_fds(), fds);
+}
+
+// Counts the phases finished by another thread than the one running them.
+class FinishingThread : public StatPhaseExtension {
+public:
+    static std::atomic<int> s_finished, s_elsewhere;
+
+    const std::thread::id m_thread = std::this_thread::get_id();
+
+    virtual void finish() override {
+        ++s_finished;
+        if(std::this_thread::get_id() != m_thread) ++s_elsewhere;
+    }
+
+    virtual void write(json&) override {
+    }
+};
+
+std::atomic<int> FinishingThread::s_finished(0);
+std::atomic<int> FinishingThread::s_elsewhere(0);
+
+TEST(Extensions, finished_on_running_thread) {
+    StatPhase::register_extension<FinishingThread>();
+
+    {
+        tdc::StatPhase root("Root");
+        std::thread worker([&](){
+            auto attached = StatPhase::attach_thread(root, 0);
+            tdc::StatPhase phase("worker");
+            phase.split("worker end");
+        });
+        worker.join();
+    }
+
+    // the attached phases are merged by the main thread
+    ASSERT_EQ(FinishingThread::s_finished.load(), 3);
+    ASSERT_EQ(FinishingThread::s_elsewhere.load(), 0);
+}
+
+TEST(Extensions, resource_usage) {
+    StatPhase::register_extension<ResourceUsage>();
+
+    // touching fresh pages causes minor page faults
+    const size_t n = 16 * 1024 * 1024;
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase sub("sub");
+            char* volatile data = (char*)malloc(n);
+            for(size_t i = 0; i < n; i += 4096) data[i] = 1;
+            free(data);
+        }
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    auto r = stat(j, "resourceUsage");
+    auto r_sub = stat(j["sub"][0], "resourceUsage");
+    ASSERT_GE(uint64_t(r_sub["minorFaults"]), n / 4096 / 2);
+    ASSERT_GE(double(r_sub["userTime"]) + double(r_sub["systemTime"]), 0.0);
+    ASSERT_GT(int64_t(r_sub["maxRss"]), 0);
+
+    // the root's measurement runs through its sub phase
+    ASSERT_GE(uint64_t(r["minorFaults"]), uint64_t(r_sub["minorFaults"]));
+    ASSERT_GE(int64_t(r["maxRssGrowth"]), int64_t(r_sub["maxRssGrowth"]));
+}
+
+TEST(Extensions, process_io) {
+    StatPhase::register_extension<ProcessIO>();
+
+    ProcessIO::counters_t counters;
+    if(!ProcessIO::read_counters(counters)) {
+        // no I/O accounting on this system
+        return;
+    }
+
+    std::vector<char> buf(64 * 1024, 'x');
+    std::FILE* f = std::tmpfile();
+    ASSERT_NE(f, nullptr);
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase sub("sub");
+            for(size_t i = 0; i < 16; i++) {
+                ASSERT_EQ(::write(fileno(f), buf.data(), buf.size()),
+                    ssize_t(buf.size()));
+            }
+        }
+        j = root.to_json();
+    }
+    std::fclose(f);
+    std::cout << j.dump(4) << std::endl;
+
+    auto io = stat(j, "processIO");
+    auto io_sub = stat(j["sub"][0], "processIO");
+    ASSERT_GE(uint64_t(io_sub["writeChars"]), 16 * buf.size());
+    ASSERT_GE(uint64_t(io_sub["writeCalls"]), 16U);
+    ASSERT_GT(double(io_sub["writeRate"]), 0.0);
+
+    // the root's counters run through its sub phase
+    ASSERT_GE(uint64_t(io["writeChars"]), uint64_t(io_sub["writeChars"]));
+
+    // reading the counters is not counted
+    ProcessIO::counters_t again;
+    ASSERT_TRUE(ProcessIO::read_counters(counters));
+    ASSERT_TRUE(ProcessIO::read_counters(again));
+    ASSERT_EQ(again.syscr, counters.syscr);
+    ASSERT_EQ(again.rchar, counters.rchar);
+}
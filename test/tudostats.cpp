@@ -1,12 +1,37 @@
 #include <gtest/gtest.h>
 
 #include <tudocomp_stat/StatPhase.hpp>
+#include <tudocomp_stat/ParallelPhase.hpp>
 #include <tudocomp_stat/StatPhaseDummy.hpp>
+#include <tudocomp_stat/malloc.hpp>
 
+#include <cerrno>
+#include <cstdint>
+#include <malloc.h>
 #include <memory>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
 
 using namespace tdc;
 
+// Returns the amount of bytes tracked for an allocation of the given size.
+//
+// In headerless mode, this is the usable size reported by the allocator.
+// The usable size of blocks with an extended alignment depends on their
+// placement, so tests can only give a lower bound for those.
+inline int tracked(size_t size) {
+#ifdef MALLOC_HEADERLESS
+    void* p = __libc_malloc(size);
+    const size_t usable = malloc_usable_size(p);
+    __libc_free(p);
+    return int(usable);
+#else
+    return int(size);
+#endif
+}
+
 // NB: If you end up getting a infinite recursion segfault here, its because
 // of some bad interaction between gtest and json during printing of an
 // assertion failure.
@@ -33,7 +58,7 @@ TEST(Tudostats, phase_root100) {
 
     ASSERT_EQ((int)j["memFinal"], 0);
     ASSERT_EQ((int)j["memOff"], 0);
-    ASSERT_EQ((int)j["memPeak"], 100);
+    ASSERT_EQ((int)j["memPeak"], tracked(100));
 }
 
 TEST(Tudostats, phase_root400_sub2_200) {
@@ -57,17 +82,17 @@ TEST(Tudostats, phase_root400_sub2_200) {
 
     ASSERT_EQ((int)j["memFinal"], 0);
     ASSERT_EQ((int)j["memOff"], 0);
-    ASSERT_EQ((int)j["memPeak"], 500);
+    ASSERT_EQ((int)j["memPeak"], tracked(300) + tracked(200));
 
     auto s1 = j["sub"][0];
     ASSERT_EQ(int(s1["memFinal"]), 0);
-    ASSERT_EQ(int(s1["memOff"]), 300);
-    ASSERT_EQ(int(s1["memPeak"]), 100);
+    ASSERT_EQ(int(s1["memOff"]), tracked(300));
+    ASSERT_EQ(int(s1["memPeak"]), tracked(100));
 
     auto s2 = j["sub"][1];
     ASSERT_EQ(int(s2["memFinal"]), 0);
-    ASSERT_EQ(int(s2["memOff"]), 300);
-    ASSERT_EQ(int(s2["memPeak"]), 200);
+    ASSERT_EQ(int(s2["memOff"]), tracked(300));
+    ASSERT_EQ(int(s2["memPeak"]), tracked(200));
 }
 
 TEST(Tudostats, phaseroot_400_sub1_100_cross_mem) {
@@ -86,16 +111,16 @@ TEST(Tudostats, phaseroot_400_sub1_100_cross_mem) {
 
     ASSERT_EQ((int)j["memFinal"], 0);
     ASSERT_EQ((int)j["memOff"], 0);
-    ASSERT_EQ((int)j["memPeak"], 400);
+    ASSERT_EQ((int)j["memPeak"], tracked(300) + tracked(100));
 
     auto s1 = j["sub"][0];
-    ASSERT_EQ(int(s1["memFinal"]), 100);
-    ASSERT_EQ(int(s1["memOff"]), 300);
-    ASSERT_EQ(int(s1["memPeak"]), 100);
+    ASSERT_EQ(int(s1["memFinal"]), tracked(100));
+    ASSERT_EQ(int(s1["memOff"]), tracked(300));
+    ASSERT_EQ(int(s1["memPeak"]), tracked(100));
 
     auto s2 = j["sub"][1];
-    ASSERT_EQ(int(s2["memFinal"]), -100);
-    ASSERT_EQ(int(s2["memOff"]), 400);
+    ASSERT_EQ(int(s2["memFinal"]), -tracked(100));
+    ASSERT_EQ(int(s2["memOff"]), tracked(300) + tracked(100));
     ASSERT_EQ(int(s2["memPeak"]), 0);
 }
 
@@ -123,15 +148,830 @@ TEST(Tudostats, logging) {
 
     ASSERT_EQ(int(j["memFinal"]), 0);
     ASSERT_EQ(int(j["memOff"]), 0);
-    ASSERT_EQ(int(j["memPeak"]), 400);
+    ASSERT_EQ(int(j["memPeak"]), tracked(300) + tracked(100));
 
     auto s1 = j["sub"][0];
-    ASSERT_EQ(int(s1["memFinal"]), 100);
-    ASSERT_EQ(int(s1["memOff"]), 300);
-    ASSERT_EQ(int(s1["memPeak"]), 100);
+    ASSERT_EQ(int(s1["memFinal"]), tracked(100));
+    ASSERT_EQ(int(s1["memOff"]), tracked(300));
+    ASSERT_EQ(int(s1["memPeak"]), tracked(100));
 
     auto s2 = j["sub"][1];
-    ASSERT_EQ(int(s2["memFinal"]), -100);
-    ASSERT_EQ(int(s2["memOff"]), 400);
+    ASSERT_EQ(int(s2["memFinal"]), -tracked(100));
+    ASSERT_EQ(int(s2["memOff"]), tracked(300) + tracked(100));
     ASSERT_EQ(int(s2["memPeak"]), 0);
 }
+
+TEST(Tudostats, nested_running_phases) {
+    tdc::StatPhase root("Root");
+    auto x1 = std::make_unique<char[]>(100);
+    {
+        tdc::StatPhase sub1("sub1");
+        auto x2 = std::make_unique<char[]>(200);
+        {
+            tdc::StatPhase sub2("sub2");
+            std::make_unique<char[]>(400);
+            auto x3 = std::make_unique<char[]>(50);
+
+            // sub phases are still running, the result is released
+            // before the guard
+            auto guard = StatPhase::suppress_tracking();
+            auto j = root.to_json();
+            std::cout << j.dump(4) << std::endl;
+
+            ASSERT_EQ(int(j["memFinal"]),
+                tracked(100) + tracked(200) + tracked(50));
+            ASSERT_EQ(int(j["memPeak"]),
+                tracked(100) + tracked(200) + tracked(400));
+        }
+        auto guard = StatPhase::suppress_tracking();
+        auto j = sub1.to_json();
+        std::cout << j.dump(4) << std::endl;
+
+        ASSERT_EQ(int(j["memOff"]), tracked(100));
+        ASSERT_EQ(int(j["memFinal"]), tracked(200));
+        ASSERT_EQ(int(j["memPeak"]), tracked(200) + tracked(400));
+
+        auto s2 = j["sub"][0];
+        ASSERT_EQ(int(s2["memOff"]), tracked(200));
+        ASSERT_EQ(int(s2["memFinal"]), 0);
+        ASSERT_EQ(int(s2["memPeak"]), tracked(400));
+    }
+    x1.reset();
+
+    auto j = root.to_json();
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_EQ(int(j["memPeak"]),
+        tracked(100) + tracked(200) + tracked(400));
+}
+
+TEST(Tudostats, aligned_alloc) {
+    tdc::StatPhase root("Root");
+    {
+        void* volatile p1 = aligned_alloc(64, 640);
+        ASSERT_EQ(uintptr_t(p1) % 64, 0U);
+
+        void* p2 = nullptr;
+        ASSERT_EQ(posix_memalign(&p2, 4096, 1000), 0);
+        ASSERT_EQ(uintptr_t(p2) % 4096, 0U);
+
+        void* p3 = memalign(256, 100);
+        ASSERT_EQ(uintptr_t(p3) % 256, 0U);
+
+        // realloc does not keep the alignment, but the contents
+        memset(p3, 42, 100);
+        p3 = realloc(p3, 200);
+        ASSERT_EQ(((char*)p3)[99], 42);
+
+        free(p1);
+        free(p2);
+        free(p3);
+
+        // the size plus the offset for the header must not overflow
+        volatile size_t huge = SIZE_MAX - 8;
+        errno = 0;
+        ASSERT_EQ(aligned_alloc(64, huge), nullptr);
+        ASSERT_EQ(errno, ENOMEM);
+
+        // alignments beyond the largest power of two cannot be rounded up
+        volatile size_t alignment = SIZE_MAX / 2 + 2;
+        errno = 0;
+        ASSERT_EQ(memalign(alignment, 100), nullptr);
+        ASSERT_EQ(errno, EINVAL);
+    }
+    auto j = root.to_json();
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+#ifdef MALLOC_HEADERLESS
+    ASSERT_GE(int(j["memPeak"]), 640 + 1000 + tracked(200));
+#else
+    ASSERT_EQ(int(j["memPeak"]), 640 + 1000 + 100 + 200);
+#endif
+}
+
+TEST(Tudostats, new_delete) {
+    struct object_t {
+        char data[100];
+        ~object_t() {}
+    };
+
+    tdc::StatPhase root("Root");
+    {
+        // sized delete
+        object_t* volatile p1 = new object_t();
+        delete p1;
+
+        // sized delete[] including the array cookie
+        object_t* volatile p2 = new object_t[3];
+        delete[] p2;
+
+        // unsized delete[]
+        char* volatile p3 = new char[50];
+        delete[] p3;
+    }
+    auto j = root.to_json();
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_EQ(int(j["memPeak"]), tracked(3 * 100 + sizeof(size_t)));
+}
+
+#ifdef __cpp_aligned_new
+TEST(Tudostats, aligned_new) {
+    struct alignas(64) aligned_t {
+        char data[128];
+    };
+
+    tdc::StatPhase root("Root");
+    {
+        auto p = std::make_unique<aligned_t>();
+        ASSERT_EQ(uintptr_t(p.get()) % 64, 0U);
+    }
+    auto j = root.to_json();
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+#ifdef MALLOC_HEADERLESS
+    ASSERT_GE(int(j["memPeak"]), 128);
+#else
+    ASSERT_EQ(int(j["memPeak"]), 128);
+#endif
+}
+#endif
+
+#if defined(__linux__) && defined(__LP64__)
+TEST(Tudostats, mmap) {
+    const int page = sysconf(_SC_PAGESIZE);
+
+    tdc::StatPhase root("Root");
+    {
+        char* p = (char*)mmap(NULL, 4 * page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ASSERT_NE((void*)p, MAP_FAILED);
+
+        {
+            tdc::StatPhase sub("Unmap");
+            ASSERT_EQ(munmap(p + page, page), 0);
+        }
+
+        // grows the last two pages to four
+        char* q = (char*)mremap(p + 2 * page, 2 * page, 4 * page,
+            MREMAP_MAYMOVE);
+        ASSERT_NE((void*)q, MAP_FAILED);
+
+        ASSERT_EQ(munmap(p, page), 0);
+        ASSERT_EQ(munmap(q, 4 * page), 0);
+    }
+    auto j = root.to_json();
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_EQ(int(j["memPeak"]), 5 * page);
+    ASSERT_EQ(int(j["memMapped"]), 0);
+
+    auto sub = j["sub"][0];
+    ASSERT_EQ(int(sub["memFinal"]), -page);
+    ASSERT_EQ(int(sub["memMapped"]), -page);
+}
+#endif
+
+TEST(Tudostats, alloc_calls) {
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        void* volatile a = malloc(100);
+        void* volatile b = calloc(10, 10);
+        {
+            tdc::StatPhase sub1("sub1");
+            a = realloc(a, 200);
+            free(b);
+            std::make_unique<char[]>(100);
+        }
+        free(a);
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["numMalloc"]), 2);
+    ASSERT_EQ(int(j["numFree"]), 3);
+    ASSERT_EQ(int(j["numRealloc"]), 1);
+    ASSERT_EQ(int(j["numCalloc"]), 1);
+    ASSERT_GT(double(j["allocsPerSecond"]), 0.0);
+
+    auto s1 = j["sub"][0];
+    ASSERT_EQ(int(s1["numMalloc"]), 1);
+    ASSERT_EQ(int(s1["numFree"]), 2);
+    ASSERT_EQ(int(s1["numRealloc"]), 1);
+    ASSERT_EQ(int(s1["numCalloc"]), 0);
+}
+
+TEST(Tudostats, calloc) {
+    json j;
+    {
+        tdc::StatPhase root("Root");
+
+        // reuse freed memory, which must be zeroed
+        void* volatile dirty = malloc(8000);
+        memset(dirty, 42, 8000);
+        free(dirty);
+
+        int* zeroed = (int*)calloc(1000, sizeof(int));
+        ASSERT_NE(zeroed, nullptr);
+        for(size_t i = 0; i < 1000; i++) ASSERT_EQ(zeroed[i], 0);
+
+        // num * size must not overflow, the sizes are volatile so the
+        // compiler does not warn about them
+        volatile size_t half = SIZE_MAX / 2, max = SIZE_MAX;
+        errno = 0;
+        ASSERT_EQ(calloc(half, 4), nullptr);
+        ASSERT_EQ(errno, ENOMEM);
+        ASSERT_EQ(calloc(1, max), nullptr);
+
+        free(zeroed);
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_GE(int(j["memPeak"]), tracked(1000 * sizeof(int)));
+    ASSERT_EQ(int(j["numCalloc"]), 3);
+}
+
+TEST(Tudostats, budget_fail) {
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        root.set_budget(10000, StatPhase::BUDGET_FAIL);
+
+        void* volatile a = malloc(5000);
+        ASSERT_NE(a, nullptr);
+
+        errno = 0;
+        ASSERT_EQ(malloc(6000), nullptr);
+        ASSERT_EQ(errno, ENOMEM);
+
+        // refused reallocations keep the block
+        ASSERT_EQ(realloc(a, 20000), nullptr);
+        ((char*)a)[4999] = 1;
+        {
+            // the sub phase inherits what is left of the budget
+            tdc::StatPhase sub1("sub1");
+            void* volatile b = malloc(4000);
+            ASSERT_NE(b, nullptr);
+            ASSERT_EQ(malloc(2000), nullptr);
+            // new expressions may be elided, calls of the operator may not
+            ASSERT_THROW(::operator delete[](::operator new[](2000)),
+                std::bad_alloc);
+            free(b);
+
+            // the sub phase refers to the budget of the root
+            ASSERT_THROW(root.set_budget(20000), std::runtime_error);
+        }
+        free(a);
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    // throwing bad_alloc may allocate as well
+    ASSERT_GE(int(j["memPeak"]), tracked(5000) + tracked(4000));
+    ASSERT_LE(int(j["memPeak"]), 10000);
+    ASSERT_EQ(int(j["memBudget"]), 10000);
+    ASSERT_EQ(int(j["memBudgetExceeded"]), 4);
+
+    auto s1 = j["sub"][0];
+    ASSERT_EQ(int(s1["memBudget"]), 10000 - tracked(5000));
+    ASSERT_EQ(int(s1["memBudgetExceeded"]), 2);
+}
+
+TEST(Tudostats, budget_callback) {
+    size_t calls = 0;
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        root.set_budget(1000, StatPhase::BUDGET_CALLBACK,
+            [&](StatPhase& phase){
+                ASSERT_EQ(phase.title(), "Root");
+                calls++;
+            });
+
+        void* volatile a = malloc(2000);
+        void* volatile b = malloc(2000);
+        free(a);
+        free(b);
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    // the callback is only invoked for the first exceeding allocation
+    ASSERT_EQ(calls, 1U);
+    ASSERT_EQ(int(j["memPeak"]), tracked(2000) * 2);
+    ASSERT_EQ(int(j["memBudgetExceeded"]), 2);
+}
+
+TEST(Tudostats, arena) {
+    constexpr size_t chunk_size = 4096;
+    constexpr size_t num_objects = 1000;
+
+    StatPhase::set_arena_options(chunk_size);
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        ASSERT_THROW(StatPhase::set_arena_options(chunk_size),
+            std::runtime_error);
+        {
+            tdc::StatPhase sub1("sub1");
+            ASSERT_EQ(&StatPhase::current_arena(), &sub1.arena());
+
+            for(size_t i = 0; i < num_objects; i++) {
+                auto p = (uint64_t*)StatPhase::current_arena().allocate(
+                    sizeof(uint64_t));
+                ASSERT_EQ(uintptr_t(p) % alignof(uint64_t), 0U);
+                *p = i;
+            }
+
+            void* aligned = sub1.arena().allocate(100, 256);
+            ASSERT_EQ(uintptr_t(aligned) % 256, 0U);
+
+            // the next phase gets a new arena
+            sub1.split("sub2");
+            sub1.arena().allocate(chunk_size * 2);
+        }
+        j = root.to_json();
+    }
+    StatPhase::set_arena_options(1024 * 1024);
+    std::cout << j.dump(4) << std::endl;
+
+    // the chunks are freed with the phase
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_EQ(j.count("arenaBytes"), 0U);
+
+    auto s1 = j["sub"][0];
+    ASSERT_EQ(int(s1["memFinal"]), 0);
+    ASSERT_GE(int(s1["memPeak"]), int(num_objects * sizeof(uint64_t)));
+    ASSERT_EQ(int(s1["arenaBytes"]), int(num_objects * sizeof(uint64_t) + 100));
+    ASSERT_EQ(int(s1["arenaChunks"]), int(s1["numMalloc"]));
+    ASSERT_EQ(int(s1["arenaChunks"]), int(s1["numFree"]));
+
+    auto s2 = j["sub"][1];
+    ASSERT_EQ(int(s2["arenaChunks"]), 1);
+    ASSERT_GT(int(s2["memPeak"]), int(chunk_size * 2));
+}
+
+#ifndef MALLOC_HEADERLESS
+TEST(Tudostats, sampling) {
+    constexpr size_t interval = 4096;
+    constexpr size_t num_blocks = 10000;
+    constexpr size_t size = 64;
+    constexpr size_t large_size = 100 * interval;
+
+    std::vector<void*> blocks(num_blocks);
+
+    StatPhase::set_sample_interval(interval);
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase sub1("sub1");
+            for(auto& p : blocks) p = malloc(size);
+
+            // large blocks are sampled with their size
+            std::make_unique<char[]>(large_size);
+        }
+        for(auto p : blocks) free(p);
+        j = root.to_json();
+    }
+    StatPhase::set_sample_interval(0);
+    std::cout << j.dump(4) << std::endl;
+
+    // frees are tracked with the same weight as the allocation
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_EQ(int(j["memSampleInterval"]), int(interval));
+
+    // the estimates are within twice the reported error bound (4 sigma)
+    auto s1 = j["sub"][0];
+    const double final_bytes = num_blocks * size;
+    const double peak_bytes = final_bytes + large_size;
+    ASSERT_NEAR(double(s1["memFinal"]), final_bytes,
+        2.0 * double(s1["memFinalError"]));
+    ASSERT_NEAR(double(s1["memPeak"]), peak_bytes,
+        2.0 * double(s1["memPeakError"]));
+}
+
+TEST(Tudostats, sampling_interval_change) {
+    // with an interval of one byte, blocks are sampled with their size,
+    // regardless of the distance drawn for a previous interval
+    StatPhase::set_sample_interval(1ULL << 30);
+    free(malloc(1));
+    StatPhase::set_sample_interval(1);
+    void* volatile block = malloc(1000);
+    void* volatile first = malloc(1000);
+    void* volatile grown = realloc(first, 2000);
+
+    StatPhase::set_sample_interval(1ULL << 30);
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        free(block);
+        free(grown);
+        j = root.to_json();
+    }
+    StatPhase::set_sample_interval(0);
+    std::cout << j.dump(4) << std::endl;
+
+    // the blocks are untracked with the weight they were tracked with
+    ASSERT_EQ(int(j["memFinal"]), -1000 - 2000);
+}
+#endif
+
+#ifndef MALLOC_HEADERLESS
+TEST(Tudostats, malloc_backend) {
+    void* volatile before = malloc(100);
+
+    StatPhase::set_malloc_backend(size_class_backend);
+    ASSERT_STREQ(StatPhase::malloc_backend().name, "size_class");
+
+    void* volatile after;
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        ASSERT_THROW(StatPhase::set_malloc_backend(libc_backend),
+            std::runtime_error);
+
+        void* small = malloc(24);
+        memset(small, 42, 24);
+        small = realloc(small, 2000);
+        ASSERT_EQ(((char*)small)[23], 42);
+
+        void* volatile aligned = aligned_alloc(256, 300);
+        ASSERT_EQ(uintptr_t(aligned) % 256, 0U);
+
+        void* large = malloc(100000);
+        large = realloc(large, 200000);
+
+        free(small);
+        free(aligned);
+        free(large);
+        free(before);
+
+        after = malloc(50);
+        j = root.to_json();
+    }
+
+    // blocks are released by the backend that allocated them
+    StatPhase::set_malloc_backend(libc_backend);
+    ASSERT_STREQ(StatPhase::malloc_backend().name, "libc");
+    free(after);
+
+    std::cout << j.dump(4) << std::endl;
+    ASSERT_EQ(int(j["memFinal"]), 50 - 100);
+    ASSERT_EQ(int(j["memPeak"]), 2000 + 300 + 200000);
+}
+#endif
+
+// Spawns the given amount of threads executing func and joins them.
+//
+// Creating a thread may allocate memory for its stack which is not released
+// when the thread ends, but kept for the next one. Thus, we spawn threads
+// once before any phase is started.
+template<typename F>
+void run_threads(size_t num_threads, F func) {
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for(size_t t = 0; t < num_threads; t++) {
+        threads.emplace_back(func, t);
+    }
+    for(auto& thread : threads) thread.join();
+}
+
+TEST(Tudostats, threads_cross_mem) {
+    constexpr size_t num_threads = 8;
+    constexpr size_t num_allocs = 1000;
+    constexpr size_t size = 64;
+
+    std::vector<std::vector<void*>> blocks(num_threads);
+    for(auto& b : blocks) b.reserve(num_allocs);
+
+    run_threads(num_threads, [](size_t){});
+
+    tdc::StatPhase root("Root");
+    {
+        tdc::StatPhase sub1("sub1");
+        run_threads(num_threads, [&blocks](size_t t){
+            for(size_t i = 0; i < num_allocs; i++) {
+                blocks[t].push_back(malloc(size));
+            }
+        });
+
+        sub1.split("sub2");
+        run_threads(num_threads, [&blocks](size_t t){
+            for(void* p : blocks[t]) free(p);
+        });
+    }
+    auto j = root.to_json();
+    std::cout << j.dump(4) << std::endl;
+
+    const int total = num_threads * num_allocs * tracked(size);
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_GE(int(j["memPeak"]), total);
+
+    auto s1 = j["sub"][0];
+    ASSERT_EQ(int(s1["memFinal"]), total);
+    ASSERT_GE(int(s1["memPeak"]), total);
+    ASSERT_GE(int(s1["numMalloc"]), int(num_threads * num_allocs));
+
+    auto s2 = j["sub"][1];
+    ASSERT_EQ(int(s2["memFinal"]), -total);
+    ASSERT_EQ(int(s2["memOff"]), total);
+    ASSERT_GE(int(s2["numFree"]), int(num_threads * num_allocs));
+}
+
+TEST(Tudostats, threads_unbuffered_peak) {
+    constexpr size_t num_threads = 4;
+    constexpr size_t size = 1000;
+
+    run_threads(num_threads, [](size_t){});
+
+    StatPhase::set_thread_buffer_size(0);
+    tdc::StatPhase root("Root");
+    {
+        run_threads(num_threads, [](size_t){
+            for(size_t i = 0; i < 100; i++) {
+                void* volatile p = malloc(size);
+                free(p);
+            }
+        });
+    }
+    auto j = root.to_json();
+    StatPhase::set_thread_buffer_size(64 * 1024);
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_GE(int(j["memPeak"]), tracked(size));
+    ASSERT_LE(int(j["memPeak"]), int(num_threads) * tracked(size) + 1024);
+}
+
+TEST(Tudostats, cpu_time) {
+    // spins until the given thread CPU time in milliseconds has passed
+    auto spin = [](double millis){
+        timespec start, now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        do {
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        } while(double(now.tv_sec - start.tv_sec) * 1000.0 +
+                double(now.tv_nsec - start.tv_nsec) / 1e6 < millis);
+    };
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::StatPhase busy("busy");
+            spin(20);
+            busy.split("idle");
+            usleep(20000);
+            busy.split("threads");
+            run_threads(2, [&](size_t){ spin(10); });
+        }
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    auto busy = j["sub"][0];
+    ASSERT_GE(double(busy["timeThreadCpu"]), 20.0);
+    ASSERT_GE(double(busy["timeCpu"]), double(busy["timeThreadCpu"]) - 0.1);
+    ASSERT_GT(double(busy["cpuUtilization"]), 0.5);
+
+    auto idle = j["sub"][1];
+    ASSERT_LT(double(idle["cpuUtilization"]), 0.5);
+
+    // the work of other threads only counts for the process
+    auto threads = j["sub"][2];
+    ASSERT_GE(double(threads["timeCpu"]), 20.0);
+    ASSERT_LT(double(threads["timeThreadCpu"]), 10.0);
+
+    ASSERT_GE(double(j["timeCpu"]), 40.0);
+}
+
+TEST(Tudostats, tsc_clock) {
+    if(!StatPhase::set_time_source(StatPhase::TIME_TSC)) {
+        // falls back to the monotonic clock
+        ASSERT_EQ(StatPhase::time_source(), StatPhase::TIME_MONOTONIC);
+        return;
+    }
+    ASSERT_EQ(StatPhase::time_source(), StatPhase::TIME_TSC);
+
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    const double now = double(t.tv_sec) * 1000.0 + double(t.tv_nsec) / 1e6;
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        usleep(20000);
+        j = root.to_json();
+    }
+    StatPhase::set_time_source(StatPhase::TIME_MONOTONIC);
+    std::cout << j.dump(4) << std::endl;
+
+    // the counter is converted to the monotonic time line
+    ASSERT_NEAR(double(j["timeStart"]), now, 100.0);
+    ASSERT_GE(double(j["timeDelta"]), 19.0);
+    ASSERT_LT(double(j["timeDelta"]), 1000.0);
+}
+
+TEST(Tudostats, thread_phases) {
+    constexpr size_t num_threads = 3;
+    run_threads(num_threads, [](size_t){});
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        void* volatile a = malloc(100);
+
+        // the threads finish in reverse order of their index
+        std::atomic<size_t> finished(0);
+        for(size_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t](){
+                auto attached = StatPhase::attach_thread(root, t);
+                tdc::StatPhase worker("worker");
+                StatPhase::log("index", t);
+                void* volatile b = malloc(1000 * (t + 1));
+                {
+                    tdc::StatPhase sub("sub");
+                    void* volatile c = malloc(500);
+                    free(c);
+                }
+                while(finished.load() != num_threads - 1 - t) {
+                    std::this_thread::yield();
+                }
+                worker.split("worker end");
+                free(b);
+                finished++;
+            });
+        }
+
+        // the main thread's phases are not disturbed by the threads
+        {
+            tdc::StatPhase main("main");
+            void* volatile d = malloc(200);
+            free(d);
+        }
+        for(auto& thread : threads) thread.join();
+
+        free(a);
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    ASSERT_EQ(j["sub"].size(), 1 + 2 * num_threads);
+    auto main = j["sub"][0];
+    ASSERT_EQ(main["title"], "main");
+    ASSERT_EQ(int(main["memPeak"]), tracked(200));
+
+    // merged in order of the thread index
+    for(size_t t = 0; t < num_threads; t++) {
+        auto worker = j["sub"][1 + 2 * t];
+        ASSERT_EQ(worker["title"], "worker");
+        ASSERT_EQ(size_t(worker["thread"]), t);
+        ASSERT_EQ(worker["stats"].size(), 1U);
+        ASSERT_EQ(worker["stats"][0]["key"], "index");
+        ASSERT_EQ(size_t(worker["stats"][0]["value"]), t);
+        ASSERT_EQ(int(worker["memPeak"]),
+            tracked(1000 * (t + 1)) + tracked(500));
+        ASSERT_EQ(int(worker["memFinal"]), tracked(1000 * (t + 1)));
+        ASSERT_EQ(worker["sub"].size(), 1U);
+        ASSERT_EQ(int(worker["sub"][0]["memPeak"]), tracked(500));
+
+        auto end = j["sub"][2 + 2 * t];
+        ASSERT_EQ(end["title"], "worker end");
+        ASSERT_EQ(size_t(end["thread"]), t);
+        ASSERT_EQ(int(end["memFinal"]), -tracked(1000 * (t + 1)));
+    }
+
+    ASSERT_EQ(int(j["memFinal"]), 0);
+    ASSERT_GE(int(j["memPeak"]),
+        tracked(100) + tracked(1000 * num_threads) + tracked(500));
+
+    // statistics logged by the threads go to their own phases
+    ASSERT_EQ(j["stats"].size(), 0U);
+}
+
+TEST(Tudostats, thread_phases_paused) {
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        std::thread thread([&](){
+            auto attached = StatPhase::attach_thread(root, 0);
+            tdc::StatPhase worker("worker");
+            {
+                auto guard = StatPhase::suppress_tracking();
+                usleep(20000);
+            }
+        });
+        thread.join();
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    // the pause is accounted to the phase of the pausing thread
+    ASSERT_GE(double(j["sub"][0]["timePaused"]), 19.0);
+    ASSERT_LT(double(j["timePaused"]), 19.0);
+}
+
+TEST(Tudostats, thread_phases_unattached) {
+    tdc::StatPhase root("Root");
+    json worker_json;
+    std::thread thread([&](){
+        // without attaching, the phase has no parent
+        tdc::StatPhase worker("worker");
+        void* volatile b = malloc(1000);
+        free(b);
+        worker_json = worker.to_json();
+    });
+    thread.join();
+    auto j = root.to_json();
+    std::cout << j.dump(4) << std::endl;
+
+    // only the thread's creation counts for the root
+    ASSERT_EQ(j["sub"].size(), 0U);
+    ASSERT_LT(int(j["memPeak"]), tracked(1000));
+    ASSERT_EQ(int(worker_json["memPeak"]), tracked(1000));
+}
+
+TEST(Tudostats, thread_phases_settings) {
+    std::atomic<int> step(0);
+    auto root = std::make_unique<tdc::StatPhase>("Root");
+    std::thread thread([&](){
+        tdc::StatPhase worker("worker");
+        step = 1;
+        while(step.load() != 2) std::this_thread::yield();
+
+        // the worker outlives the root, but is still a running measurement
+        ASSERT_THROW(StatPhase::set_sample_interval(0), std::runtime_error);
+        ASSERT_THROW(StatPhase::set_arena_options(4096), std::runtime_error);
+    });
+    while(step.load() != 1) std::this_thread::yield();
+    root.reset();
+    step = 2;
+    thread.join();
+}
+
+TEST(Tudostats, parallel_phase) {
+    constexpr size_t num_threads = 3;
+    run_threads(num_threads, [](size_t){});
+
+    json j;
+    {
+        tdc::StatPhase root("Root");
+        {
+            tdc::ParallelPhase region("region");
+
+            // thread t works (t + 1) times as long, the calling thread
+            // takes part as thread 0
+            auto work = [&](size_t t){
+                region.run(t, [&](){
+                    void* volatile p = malloc(1000);
+                    usleep(10000 * (t + 1));
+                    free(p);
+                });
+            };
+
+            std::vector<std::thread> threads;
+            threads.reserve(num_threads - 1);
+            for(size_t t = 1; t < num_threads; t++) {
+                threads.emplace_back(work, t);
+            }
+            work(0);
+            for(auto& thread : threads) thread.join();
+        }
+        j = root.to_json();
+    }
+    std::cout << j.dump(4) << std::endl;
+
+    auto region = j["sub"][0];
+    ASSERT_EQ(region["sub"].size(), num_threads);
+    for(size_t t = 0; t < num_threads; t++) {
+        auto phase = region["sub"][t];
+        ASSERT_EQ(phase["title"], "Thread " + std::to_string(t));
+        ASSERT_EQ(size_t(phase["thread"]), t);
+        ASSERT_EQ(int(phase["memPeak"]), tracked(1000));
+    }
+
+    json stats;
+    for(auto& entry : region["stats"]) stats[entry["key"].get<std::string>()] =
+        entry["value"];
+    ASSERT_EQ(size_t(stats["threads"]), num_threads);
+    ASSERT_GE(double(stats["threadTimeMin"]), 10.0);
+    ASSERT_GE(double(stats["threadTimeMax"]), 30.0);
+    ASSERT_NEAR(double(stats["threadTimeMean"]),
+        (double(stats["threadTimeMin"]) + double(stats["threadTimeMax"])) / 2,
+        5.0);
+    ASSERT_GT(double(stats["loadImbalance"]), 1.2);
+    ASSERT_EQ(int(region["memFinal"]), 0);
+}
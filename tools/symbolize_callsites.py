@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Symbolizes the call sites recorded by the tdc::CallSites and
+tdc::LiveAllocations extensions.
+
+Reads the JSON output of a phase tree (as written by StatPhase::to_json,
+optionally wrapped in a charter object with a "data" member) and replaces
+the raw return addresses in every callSites and liveAllocations statistic by
+function names and source locations obtained from addr2line.
+
+Usage: symbolize_callsites.py [input.json] [output.json]
+
+Reads from stdin and writes to stdout if no files are given.
+"""
+
+import json
+import subprocess
+import sys
+
+
+def is_executable_elf(path):
+    """Tells whether the ELF file at path is a non-relocatable executable."""
+    try:
+        with open(path, "rb") as f:
+            header = f.read(18)
+    except OSError:
+        return False
+    # e_type is a 16-bit value at offset 16, ET_EXEC = 2
+    return header[:4] == b"\x7fELF" and int.from_bytes(
+        header[16:18], sys.byteorder) == 2
+
+
+class Symbolizer:
+    def __init__(self):
+        self.cache = {}
+
+    def module_address(self, addr, maps):
+        """Maps a runtime address to a module and an address within it."""
+        for m in maps:
+            start = int(m["start"], 16)
+            if start <= addr < int(m["end"], 16):
+                path = m["path"]
+                if not path or path.startswith("["):
+                    return None, None
+                if is_executable_elf(path):
+                    return path, addr
+                return path, addr - start + int(m["offset"], 16)
+        return None, None
+
+    def symbolize(self, path, addresses):
+        """Runs addr2line once for all addresses within a module."""
+        todo = [a for a in addresses if (path, a) not in self.cache]
+        if todo:
+            try:
+                out = subprocess.run(
+                    ["addr2line", "-C", "-f", "-e", path] +
+                    [hex(a) for a in todo],
+                    capture_output=True, text=True, check=True).stdout
+                lines = out.splitlines()
+            except (OSError, subprocess.CalledProcessError):
+                lines = []
+            for i, a in enumerate(todo):
+                if 2 * i + 1 < len(lines):
+                    func, loc = lines[2 * i], lines[2 * i + 1]
+                    self.cache[(path, a)] = "%s at %s" % (func, loc)
+                else:
+                    self.cache[(path, a)] = "%s+%s" % (path, hex(a))
+
+    def process(self, call_sites):
+        maps = call_sites.get("maps", [])
+        lists = [call_sites.get(key, [])
+                 for key in ("byBytes", "byCount", "bySite")]
+
+        # return addresses point behind the call, so look up the call itself
+        resolved = {}
+        by_module = {}
+        for sites in lists:
+            for site in sites:
+                for frame in site["frames"]:
+                    addr = int(frame, 16)
+                    path, mod_addr = self.module_address(addr - 1, maps)
+                    resolved[frame] = (path, mod_addr)
+                    if path:
+                        by_module.setdefault(path, set()).add(mod_addr)
+
+        for path, addresses in by_module.items():
+            self.symbolize(path, sorted(addresses))
+
+        for sites in lists:
+            for site in sites:
+                symbols = []
+                for frame in site["frames"]:
+                    path, mod_addr = resolved[frame]
+                    symbols.append(self.cache[(path, mod_addr)]
+                                   if path else frame)
+                site["symbols"] = symbols
+
+    def walk(self, phase):
+        for stat in phase.get("stats", []):
+            if stat.get("key") in ("callSites", "liveAllocations"):
+                self.process(stat["value"])
+        for sub in phase.get("sub", []):
+            self.walk(sub)
+
+
+def main():
+    src = open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin
+    data = json.load(src)
+
+    Symbolizer().walk(data.get("data", data))
+
+    dst = open(sys.argv[2], "w") if len(sys.argv) > 2 else sys.stdout
+    json.dump(data, dst, indent=4)
+    dst.write("\n")
+
+
+if __name__ == "__main__":
+    main()